@@ -0,0 +1,218 @@
+/*
+ * Advertisement matcher
+ *
+ * The patterns are fixed at build time. A report is only looked at if it
+ * can carry advertising data and is at least CONFIG_BRIDGE_MATCH_RSSI_MIN
+ * strong; its fields are then walked once, in place, and the walk stops at
+ * the first field that matches. Nothing is copied or searched for.
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/gap.h>
+#include <zephyr/bluetooth/uuid.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "adv_match.h"
+
+LOG_MODULE_DECLARE(ble_bridge, LOG_LEVEL_INF);
+
+static const char match_name[] = CONFIG_BRIDGE_TARGET_NAME;
+#define MATCH_NAME_LEN (sizeof(match_name) - 1)
+
+BUILD_ASSERT(sizeof(CONFIG_BRIDGE_TARGET_NAME) > 1 ||
+             IS_ENABLED(CONFIG_BRIDGE_MATCH_HIDS_UUID) ||
+             IS_ENABLED(CONFIG_BRIDGE_MATCH_APPEARANCE),
+             "Set BRIDGE_TARGET_NAME or enable a BRIDGE_MATCH_* option");
+
+struct match_candidate {
+    bt_addr_le_t addr;
+    int16_t rssi_sum;
+    uint8_t reports;
+    bool in_adv;
+};
+
+static struct k_spinlock match_lock;
+static struct match_candidate candidates[CONFIG_BRIDGE_MATCH_CANDIDATES];  /* Guarded by match_lock */
+static uint8_t candidate_count;
+static bool match_open;                     /* Window running */
+static bool match_closed;                   /* Pick made, ignore reports until reset */
+
+/* Shortest shortened name taken for the target */
+#define MATCH_SHORT_MIN MIN(MATCH_NAME_LEN, CONFIG_BRIDGE_MATCH_SHORT_NAME_MIN)
+
+/*
+ * Complete name starts with the target, or a shortened one of at least
+ * MATCH_SHORT_MIN bytes is a prefix of it
+ */
+static bool match_name_field(const struct bt_data *data)
+{
+    if (!MATCH_NAME_LEN || !data->data_len) {
+        return false;
+    }
+
+    if (data->type == BT_DATA_NAME_COMPLETE) {
+        return data->data_len >= MATCH_NAME_LEN &&
+               !memcmp(data->data, match_name, MATCH_NAME_LEN);
+    }
+
+    /* Shortened: a prefix of the target, no longer than the target itself */
+    return data->data_len >= MATCH_SHORT_MIN && data->data_len <= MATCH_NAME_LEN &&
+           !memcmp(data->data, match_name, data->data_len);
+}
+
+#if IS_ENABLED(CONFIG_BRIDGE_MATCH_HIDS_UUID)
+static bool match_uuid16_field(const struct bt_data *data)
+{
+    for (uint8_t i = 0; i + 1 < data->data_len; i += 2) {
+        if (sys_get_le16(&data->data[i]) == BT_UUID_HIDS_VAL) {
+            return true;
+        }
+    }
+
+    return false;
+}
+#endif
+
+static bool match_field(struct bt_data *data, void *user_data)
+{
+    bool *matched = user_data;
+
+    switch (data->type) {
+    case BT_DATA_NAME_COMPLETE:
+    case BT_DATA_NAME_SHORTENED:
+        *matched = match_name_field(data);
+        break;
+#if IS_ENABLED(CONFIG_BRIDGE_MATCH_HIDS_UUID)
+    case BT_DATA_UUID16_SOME:
+    case BT_DATA_UUID16_ALL:
+        *matched = match_uuid16_field(data);
+        break;
+#endif
+#if IS_ENABLED(CONFIG_BRIDGE_MATCH_APPEARANCE)
+    case BT_DATA_GAP_APPEARANCE:
+        *matched = data->data_len == 2 &&
+                   sys_get_le16(data->data) == BT_APPEARANCE_HID_KEYBOARD;
+        break;
+#endif
+    default:
+        break;
+    }
+
+    return !*matched;
+}
+
+/* Slot for addr: its own, a free one, or the weakest if this report beats it */
+static struct match_candidate *match_slot(const bt_addr_le_t *addr, int8_t rssi)
+{
+    struct match_candidate *weakest = NULL;
+
+    for (uint8_t i = 0; i < candidate_count; i++) {
+        struct match_candidate *cand = &candidates[i];
+
+        if (bt_addr_le_eq(&cand->addr, addr)) {
+            return cand;
+        }
+        if (!weakest || cand->rssi_sum / cand->reports <
+                        weakest->rssi_sum / weakest->reports) {
+            weakest = cand;
+        }
+    }
+
+    if (candidate_count < ARRAY_SIZE(candidates)) {
+        weakest = &candidates[candidate_count++];
+    } else if (rssi <= weakest->rssi_sum / weakest->reports) {
+        return NULL;
+    }
+
+    memset(weakest, 0, sizeof(*weakest));
+    bt_addr_le_copy(&weakest->addr, addr);
+    return weakest;
+}
+
+void adv_match_reset(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&match_lock);
+
+    candidate_count = 0;
+    match_open = false;
+    match_closed = false;
+    k_spin_unlock(&match_lock, key);
+}
+
+bool adv_match_offer(const bt_addr_le_t *addr, int8_t rssi, uint8_t adv_type,
+                     struct net_buf_simple *ad)
+{
+    struct match_candidate *cand;
+    k_spinlock_key_t key;
+    bool matched = false;
+    bool first;
+
+    if (rssi < CONFIG_BRIDGE_MATCH_RSSI_MIN || match_closed) {
+        return false;
+    }
+
+    /* Only reports with advertising data from something connectable */
+    switch (adv_type) {
+    case BT_GAP_ADV_TYPE_ADV_IND:
+    case BT_GAP_ADV_TYPE_SCAN_RSP:
+    case BT_GAP_ADV_TYPE_EXT_ADV:
+        break;
+    default:
+        return false;
+    }
+
+    bt_data_parse(ad, match_field, &matched);
+    if (!matched) {
+        return false;
+    }
+
+    key = k_spin_lock(&match_lock);
+
+    if (match_closed) {
+        k_spin_unlock(&match_lock, key);
+        return false;
+    }
+
+    cand = match_slot(addr, rssi);
+    if (cand && cand->reports < UINT8_MAX) {
+        cand->rssi_sum += rssi;
+        cand->reports++;
+        cand->in_adv |= (adv_type != BT_GAP_ADV_TYPE_SCAN_RSP);
+    }
+
+    first = !match_open;
+    match_open = true;
+    k_spin_unlock(&match_lock, key);
+
+    LOG_DBG("Keyboard candidate, RSSI %d", rssi);
+    return first;
+}
+
+bool adv_match_pick(struct adv_match_candidate *best)
+{
+    const struct match_candidate *pick = NULL;
+    k_spinlock_key_t key = k_spin_lock(&match_lock);
+
+    for (uint8_t i = 0; i < candidate_count; i++) {
+        const struct match_candidate *cand = &candidates[i];
+
+        if (!pick || cand->rssi_sum / cand->reports >
+                     pick->rssi_sum / pick->reports) {
+            pick = cand;
+        }
+    }
+
+    if (pick) {
+        bt_addr_le_copy(&best->addr, &pick->addr);
+        best->rssi = (int8_t)(pick->rssi_sum / pick->reports);
+        best->in_adv = pick->in_adv;
+        best->count = candidate_count;
+        match_closed = true;
+    }
+    match_open = false;
+
+    k_spin_unlock(&match_lock, key);
+    return pick != NULL;
+}
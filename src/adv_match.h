@@ -0,0 +1,38 @@
+/*
+ * Advertisement matcher
+ *
+ * Picks the keyboard to pair with from the advertising reports of a scan.
+ * A report matches on the name prefix CONFIG_BRIDGE_TARGET_NAME and, when
+ * enabled, on the HID service UUID (CONFIG_BRIDGE_MATCH_HIDS_UUID) or the
+ * keyboard appearance (CONFIG_BRIDGE_MATCH_APPEARANCE). Matching keyboards
+ * are collected for CONFIG_BRIDGE_MATCH_WINDOW_MS after the first one and
+ * the one with the strongest mean signal is picked.
+ */
+
+#ifndef ADV_MATCH_H_
+#define ADV_MATCH_H_
+
+#include <stdbool.h>
+#include <zephyr/bluetooth/bluetooth.h>
+
+struct adv_match_candidate {
+    bt_addr_le_t addr;
+    int8_t rssi;            /* Mean over the reports seen, dBm */
+    bool in_adv;            /* Matched in an advertisement, not only a scan response */
+    uint8_t count;          /* Candidates seen in the window */
+};
+
+/* Drop all candidates, before a scan starts */
+void adv_match_reset(void);
+
+/*
+ * Look at one advertising report, from the BT RX thread. True for the
+ * first match since the reset, when the ranking window should start.
+ */
+bool adv_match_offer(const bt_addr_le_t *addr, int8_t rssi, uint8_t adv_type,
+                     struct net_buf_simple *ad);
+
+/* Close the window and take the strongest candidate; false if there is none */
+bool adv_match_pick(struct adv_match_candidate *best);
+
+#endif /* ADV_MATCH_H_ */
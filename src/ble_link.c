@@ -0,0 +1,505 @@
+/*
+ * BLE link tuning
+ *
+ * With CONFIG_BRIDGE_CONN_GOVERNOR the link has two parameter sets: the
+ * Kconfig profile while the keyboard is in use and a relaxed idle set with
+ * peripheral latency after a quiet period. The BT RX thread only stamps the
+ * time of each report; switching runs from a delayable work item on the
+ * system workqueue, which also enforces the minimum time between switches.
+ *
+ * With several devices linked they switch together: a report from any of
+ * them is activity for all. PHY and data length are asked for on every
+ * link, by the connection manager on the system workqueue; the radio info
+ * describes the first one up.
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/logging/log.h>
+
+#include "ble_link.h"
+
+LOG_MODULE_DECLARE(ble_bridge, LOG_LEVEL_INF);
+
+BUILD_ASSERT(CONFIG_BRIDGE_CONN_INTERVAL_MIN <= CONFIG_BRIDGE_CONN_INTERVAL_MAX,
+             "BRIDGE_CONN_INTERVAL_MIN must not exceed BRIDGE_CONN_INTERVAL_MAX");
+
+static const struct bt_le_conn_param link_params[BLE_LINK_STATE_COUNT] = {
+    [BLE_LINK_FAST] = BT_LE_CONN_PARAM_INIT(CONFIG_BRIDGE_CONN_INTERVAL_MIN,
+                                            CONFIG_BRIDGE_CONN_INTERVAL_MAX,
+                                            CONFIG_BRIDGE_CONN_LATENCY,
+                                            CONFIG_BRIDGE_CONN_TIMEOUT),
+#if IS_ENABLED(CONFIG_BRIDGE_CONN_GOVERNOR)
+    [BLE_LINK_IDLE] = BT_LE_CONN_PARAM_INIT(CONFIG_BRIDGE_CONN_IDLE_INTERVAL_MIN,
+                                            CONFIG_BRIDGE_CONN_IDLE_INTERVAL_MAX,
+                                            CONFIG_BRIDGE_CONN_IDLE_LATENCY,
+                                            CONFIG_BRIDGE_CONN_TIMEOUT),
+#endif
+};
+
+#if IS_ENABLED(CONFIG_BRIDGE_CONN_GOVERNOR)
+BUILD_ASSERT(CONFIG_BRIDGE_CONN_IDLE_INTERVAL_MIN <= CONFIG_BRIDGE_CONN_IDLE_INTERVAL_MAX,
+             "BRIDGE_CONN_IDLE_INTERVAL_MIN must not exceed BRIDGE_CONN_IDLE_INTERVAL_MAX");
+/* Core spec: timeout > (1 + latency) * interval * 2, in ms */
+BUILD_ASSERT(CONFIG_BRIDGE_CONN_TIMEOUT * 10 >
+             (1 + CONFIG_BRIDGE_CONN_IDLE_LATENCY) *
+             CONFIG_BRIDGE_CONN_IDLE_INTERVAL_MAX * 5 / 4 * 2,
+             "BRIDGE_CONN_TIMEOUT too short for the idle parameter set");
+#endif
+
+static struct k_spinlock link_lock;
+static struct bt_conn *link_conn;           /* Link the radio info is for, guarded by link_lock */
+static uint8_t link_count;                  /* Guarded by link_lock */
+static enum ble_link_state link_state;      /* Parameter set last requested */
+static int64_t link_state_since;            /* Uptime the state was entered, 0 if down */
+static struct ble_link_stats link_stats;
+static struct ble_link_radio link_radio;    /* Guarded by link_lock */
+static ATOMIC_DEFINE(link_up, CONFIG_BT_MAX_CONN);
+static ATOMIC_DEFINE(link_phy_asked, CONFIG_BT_MAX_CONN);
+static ATOMIC_DEFINE(link_data_len_asked, CONFIG_BT_MAX_CONN);
+
+#if IS_ENABLED(CONFIG_BRIDGE_CONN_GOVERNOR)
+static atomic_t link_last_activity;         /* k_uptime_get_32() of the last report */
+static int64_t link_last_switch;
+static struct k_work_delayable governor_work;
+#endif
+
+const struct bt_le_conn_param *ble_link_conn_param(void)
+{
+    return &link_params[BLE_LINK_FAST];
+}
+
+static bool ble_link_params_meet(enum ble_link_state state, uint16_t interval,
+                                 uint16_t latency)
+{
+    const struct bt_le_conn_param *set = &link_params[state];
+
+    return interval >= set->interval_min && interval <= set->interval_max &&
+           latency <= set->latency;
+}
+
+bool ble_link_profile_met(struct bt_conn *conn)
+{
+    struct bt_conn_info info;
+
+    if (bt_conn_get_info(conn, &info)) {
+        return false;
+    }
+
+    return ble_link_params_meet(BLE_LINK_FAST, info.le.interval, info.le.latency);
+}
+
+static void ble_link_report(uint16_t interval, uint16_t latency, uint16_t timeout)
+{
+    const struct bt_le_conn_param *set = &link_params[link_state];
+    uint32_t interval_us = BT_CONN_INTERVAL_TO_US(interval);
+
+    if (ble_link_params_meet(link_state, interval, latency)) {
+        LOG_INF("Connection interval %u.%02u ms, latency %u, timeout %u ms",
+                interval_us / 1000, (interval_us % 1000) / 10, latency,
+                timeout * 10);
+    } else {
+        LOG_WRN("Connection interval %u.%02u ms, latency %u, timeout %u ms "
+                "(%s set asks for %u-%u units, latency %u)",
+                interval_us / 1000, (interval_us % 1000) / 10, latency,
+                timeout * 10, link_state == BLE_LINK_FAST ? "fast" : "idle",
+                set->interval_min, set->interval_max, set->latency);
+    }
+}
+
+/* Charge the time since the last transition to the current state. Caller holds link_lock. */
+static void ble_link_account(int64_t now)
+{
+    if (link_state_since) {
+        link_stats.time_ms[link_state] += now - link_state_since;
+        link_state_since = now;
+    }
+}
+
+void ble_link_get_stats(struct ble_link_stats *stats)
+{
+    k_spinlock_key_t key = k_spin_lock(&link_lock);
+
+    ble_link_account(k_uptime_get());
+    *stats = link_stats;
+    k_spin_unlock(&link_lock, key);
+}
+
+void ble_link_get_radio(struct ble_link_radio *radio)
+{
+    k_spinlock_key_t key = k_spin_lock(&link_lock);
+
+    *radio = link_radio;
+    k_spin_unlock(&link_lock, key);
+}
+
+static const char *ble_link_phy_str(uint8_t phy)
+{
+    switch (phy) {
+    case BT_GAP_LE_PHY_1M:
+        return "1M";
+    case BT_GAP_LE_PHY_2M:
+        return "2M";
+    case BT_GAP_LE_PHY_CODED:
+        return "Coded";
+    default:
+        return "?";
+    }
+}
+
+/*
+ * Longest PDUs the controller allows. Asked for after the PHY update, as
+ * the time limit a PDU fits in depends on the PHY; a keyboard that refuses
+ * simply keeps the 27-octet default.
+ */
+static void ble_link_request_data_len(struct bt_conn *conn)
+{
+    int err;
+
+    if (atomic_test_and_set_bit(link_data_len_asked, bt_conn_index(conn))) {
+        return;
+    }
+
+    err = bt_conn_le_data_len_update(conn, BT_LE_DATA_LEN_PARAM_MAX);
+
+    if (err) {
+        LOG_WRN("Data length update failed (err %d), keeping default PDUs", err);
+    }
+}
+
+static void ble_link_request_phy(struct bt_conn *conn)
+{
+    int err = bt_conn_le_phy_update(conn, BT_CONN_LE_PHY_PARAM_2M);
+
+    if (err) {
+        LOG_WRN("2M PHY update failed (err %d), staying on 1M", err);
+        ble_link_request_data_len(conn);
+    }
+}
+
+void ble_link_tune(struct bt_conn *conn)
+{
+    struct bt_conn_info info;
+    uint8_t index = bt_conn_index(conn);
+
+    if (!atomic_test_bit(link_up, index) || bt_conn_get_info(conn, &info)) {
+        return;
+    }
+
+    /* Shorter air time per notification: 2M PHY first, then long PDUs */
+    if (!atomic_test_and_set_bit(link_phy_asked, index) && info.le.phy &&
+        (info.le.phy->tx_phy != BT_GAP_LE_PHY_2M ||
+         info.le.phy->rx_phy != BT_GAP_LE_PHY_2M)) {
+        ble_link_request_phy(conn);
+        return;
+    }
+
+    /* Data length follows the first PHY update */
+    ble_link_request_data_len(conn);
+}
+
+/* Start charging time to a parameter set once it has been requested */
+static void ble_link_enter(enum ble_link_state state)
+{
+    k_spinlock_key_t key = k_spin_lock(&link_lock);
+
+    ble_link_account(k_uptime_get());
+    link_state = state;
+    link_stats.switches++;
+    k_spin_unlock(&link_lock, key);
+}
+
+/* Request a parameter set on one link */
+static int ble_link_switch(struct bt_conn *conn, enum ble_link_state state)
+{
+    int err = bt_conn_le_param_update(conn, &link_params[state]);
+
+    if (!err) {
+        ble_link_enter(state);
+    }
+    return err;
+}
+
+#if IS_ENABLED(CONFIG_BRIDGE_CONN_GOVERNOR)
+struct link_switch {
+    enum ble_link_state state;
+    int err;                /* First failure, 0 if every link took it */
+};
+
+static void ble_link_switch_one(struct bt_conn *conn, void *data)
+{
+    struct link_switch *sw = data;
+    int err;
+
+    if (!atomic_test_bit(link_up, bt_conn_index(conn))) {
+        return;
+    }
+
+    err = bt_conn_le_param_update(conn, &link_params[sw->state]);
+    if (err && !sw->err) {
+        sw->err = err;
+    }
+}
+
+/* Request a parameter set on every link */
+static int ble_link_switch_all(enum ble_link_state state)
+{
+    struct link_switch sw = { .state = state };
+
+    bt_conn_foreach(BT_CONN_TYPE_LE, ble_link_switch_one, &sw);
+    if (!sw.err) {
+        ble_link_enter(state);
+    }
+    return sw.err;
+}
+#endif
+
+#if IS_ENABLED(CONFIG_BRIDGE_CONN_GOVERNOR)
+static void governor_work_handler(struct k_work *work)
+{
+    int64_t now = k_uptime_get();
+    uint32_t quiet = k_uptime_get_32() - (uint32_t)atomic_get(&link_last_activity);
+    enum ble_link_state want;
+    int64_t wait;
+    int err;
+
+    if (!link_count) {
+        return;
+    }
+
+    want = (quiet >= CONFIG_BRIDGE_CONN_IDLE_TIMEOUT_MS) ? BLE_LINK_IDLE : BLE_LINK_FAST;
+
+    if (want == link_state) {
+        if (want == BLE_LINK_FAST) {
+            k_work_reschedule(&governor_work,
+                              K_MSEC(CONFIG_BRIDGE_CONN_IDLE_TIMEOUT_MS - quiet));
+        }
+        return;
+    }
+
+    wait = link_last_switch + CONFIG_BRIDGE_CONN_SWITCH_INTERVAL_MS - now;
+    if (link_last_switch && wait > 0) {
+        k_spinlock_key_t key = k_spin_lock(&link_lock);
+
+        link_stats.deferred++;
+        k_spin_unlock(&link_lock, key);
+        k_work_reschedule(&governor_work, K_MSEC(wait));
+        return;
+    }
+
+    err = ble_link_switch_all(want);
+    if (err) {
+        LOG_WRN("Governor parameter update failed (err %d)", err);
+        k_work_reschedule(&governor_work, K_MSEC(CONFIG_BRIDGE_CONN_SWITCH_INTERVAL_MS));
+        return;
+    }
+
+    link_last_switch = now;
+    LOG_DBG("Link %s", want == BLE_LINK_FAST ? "active" : "idle");
+
+    if (want == BLE_LINK_FAST) {
+        k_work_reschedule(&governor_work, K_MSEC(CONFIG_BRIDGE_CONN_IDLE_TIMEOUT_MS));
+    }
+}
+
+void ble_link_activity(void)
+{
+    atomic_set(&link_last_activity, (atomic_val_t)k_uptime_get_32());
+
+    /* Already fast: the pending idle check will see the new timestamp */
+    if (link_state == BLE_LINK_IDLE) {
+        k_work_schedule(&governor_work, K_NO_WAIT);
+    }
+}
+#else
+void ble_link_activity(void)
+{
+}
+#endif
+
+void ble_link_init(void)
+{
+#if IS_ENABLED(CONFIG_BRIDGE_CONN_GOVERNOR)
+    k_work_init_delayable(&governor_work, governor_work_handler);
+#endif
+}
+
+void ble_link_secured(struct bt_conn *conn)
+{
+    int err;
+
+    if (ble_link_profile_met(conn)) {
+        return;
+    }
+
+    err = ble_link_switch(conn, BLE_LINK_FAST);
+    if (err) {
+        LOG_WRN("Connection parameter update failed (err %d)", err);
+    } else {
+        LOG_INF("Requested connection parameter profile");
+    }
+}
+
+static void ble_link_connected(struct bt_conn *conn, uint8_t err)
+{
+    struct bt_conn_info info;
+    struct ble_link_radio radio;
+    k_spinlock_key_t key;
+    bool first;
+
+    if (err || bt_conn_get_info(conn, &info)) {
+        return;
+    }
+
+    radio = (struct ble_link_radio){
+        .tx_phy = info.le.phy ? info.le.phy->tx_phy : BT_GAP_LE_PHY_1M,
+        .rx_phy = info.le.phy ? info.le.phy->rx_phy : BT_GAP_LE_PHY_1M,
+    };
+    if (info.le.data_len) {
+        radio.tx_max_len = info.le.data_len->tx_max_len;
+        radio.tx_max_time = info.le.data_len->tx_max_time;
+        radio.rx_max_len = info.le.data_len->rx_max_len;
+        radio.rx_max_time = info.le.data_len->rx_max_time;
+    }
+
+    key = k_spin_lock(&link_lock);
+    first = (link_count++ == 0);
+    if (first) {
+        link_state = BLE_LINK_FAST;
+        link_state_since = k_uptime_get();
+    }
+    if (!link_conn) {
+        link_conn = bt_conn_ref(conn);
+        link_radio = radio;
+    }
+    k_spin_unlock(&link_lock, key);
+    atomic_clear_bit(link_phy_asked, bt_conn_index(conn));
+    atomic_clear_bit(link_data_len_asked, bt_conn_index(conn));
+    atomic_set_bit(link_up, bt_conn_index(conn));
+
+    ble_link_report(info.le.interval, info.le.latency, info.le.timeout);
+
+#if IS_ENABLED(CONFIG_BRIDGE_CONN_GOVERNOR)
+    if (first) {
+        link_last_switch = 0;
+        atomic_set(&link_last_activity, (atomic_val_t)k_uptime_get_32());
+        k_work_reschedule(&governor_work, K_MSEC(CONFIG_BRIDGE_CONN_IDLE_TIMEOUT_MS));
+    } else {
+        /* Joins on the fast set; bring any idle links back to it as well */
+        ble_link_activity();
+    }
+#endif
+}
+
+static void ble_link_disconnected(struct bt_conn *conn, uint8_t reason)
+{
+    struct ble_link_stats stats;
+    k_spinlock_key_t key;
+    bool last;
+
+    if (!atomic_test_and_clear_bit(link_up, bt_conn_index(conn))) {
+        return;
+    }
+
+    key = k_spin_lock(&link_lock);
+    if (link_conn == conn) {
+        link_conn = NULL;
+        link_radio = (struct ble_link_radio){0};
+    } else {
+        conn = NULL;
+    }
+    last = (--link_count == 0);
+    if (last) {
+        ble_link_account(k_uptime_get());
+        link_state_since = 0;
+    }
+    stats = link_stats;
+    k_spin_unlock(&link_lock, key);
+
+    if (conn) {
+        bt_conn_unref(conn);
+    }
+    if (!last) {
+        return;
+    }
+
+#if IS_ENABLED(CONFIG_BRIDGE_CONN_GOVERNOR)
+    k_work_cancel_delayable(&governor_work);
+#endif
+
+    LOG_INF("Link time fast %llu ms, idle %llu ms, %u switches (%u deferred)",
+            (unsigned long long)stats.time_ms[BLE_LINK_FAST],
+            (unsigned long long)stats.time_ms[BLE_LINK_IDLE],
+            stats.switches, stats.deferred);
+}
+
+/*
+ * Keyboard asks for other parameters. Grant what it asks for within the
+ * bounds of the current set, so the link never ends up slower than the
+ * governor wants it.
+ */
+static bool ble_link_param_req(struct bt_conn *conn, struct bt_le_conn_param *param)
+{
+    const struct bt_le_conn_param *set = &link_params[link_state];
+
+    param->interval_min = CLAMP(param->interval_min, set->interval_min,
+                                set->interval_max);
+    param->interval_max = CLAMP(param->interval_max, param->interval_min,
+                                set->interval_max);
+    param->latency = MIN(param->latency, set->latency);
+
+    LOG_DBG("Keyboard parameter request, granting %u-%u latency %u",
+            param->interval_min, param->interval_max, param->latency);
+    return true;
+}
+
+static void ble_link_param_updated(struct bt_conn *conn, uint16_t interval,
+                                   uint16_t latency, uint16_t timeout)
+{
+    ble_link_report(interval, latency, timeout);
+}
+
+static void ble_link_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *param)
+{
+    k_spinlock_key_t key = k_spin_lock(&link_lock);
+
+    if (conn == link_conn) {
+        link_radio.tx_phy = param->tx_phy;
+        link_radio.rx_phy = param->rx_phy;
+    }
+    k_spin_unlock(&link_lock, key);
+
+    if (param->tx_phy == BT_GAP_LE_PHY_2M && param->rx_phy == BT_GAP_LE_PHY_2M) {
+        LOG_INF("PHY 2M");
+    } else {
+        LOG_WRN("PHY TX %s RX %s, keyboard did not take 2M",
+                ble_link_phy_str(param->tx_phy), ble_link_phy_str(param->rx_phy));
+    }
+}
+
+static void ble_link_data_len_updated(struct bt_conn *conn,
+                                      struct bt_conn_le_data_len_info *info)
+{
+    k_spinlock_key_t key = k_spin_lock(&link_lock);
+
+    if (conn == link_conn) {
+        link_radio.tx_max_len = info->tx_max_len;
+        link_radio.tx_max_time = info->tx_max_time;
+        link_radio.rx_max_len = info->rx_max_len;
+        link_radio.rx_max_time = info->rx_max_time;
+    }
+    k_spin_unlock(&link_lock, key);
+
+    LOG_INF("Data length TX %u octets/%u us, RX %u octets/%u us",
+            info->tx_max_len, info->tx_max_time, info->rx_max_len, info->rx_max_time);
+}
+
+BT_CONN_CB_DEFINE(ble_link_callbacks) = {
+    .connected = ble_link_connected,
+    .disconnected = ble_link_disconnected,
+    .le_param_req = ble_link_param_req,
+    .le_param_updated = ble_link_param_updated,
+    .le_phy_updated = ble_link_phy_updated,
+    .le_data_len_updated = ble_link_data_len_updated,
+};
@@ -0,0 +1,72 @@
+/*
+ * BLE link tuning
+ *
+ * Connection parameters for the keyboard link. The profile selected in
+ * Kconfig (CONFIG_BRIDGE_CONN_PROFILE_*) is requested when the connection
+ * is created and again once the link is encrypted, since many peripherals
+ * only accept updates at that point. The parameters the keyboard actually
+ * grants are checked against the profile and logged.
+ *
+ * With CONFIG_BRIDGE_CONN_GOVERNOR the link relaxes to an idle parameter
+ * set after a quiet period and returns to the profile on the next report.
+ *
+ * Right after connecting the bridge also asks for LE 2M PHY and the
+ * largest data length, and stays on whatever the keyboard accepts.
+ */
+
+#ifndef BLE_LINK_H_
+#define BLE_LINK_H_
+
+#include <stdbool.h>
+#include <zephyr/bluetooth/conn.h>
+
+/* Parameter sets the governor switches between */
+enum ble_link_state {
+    BLE_LINK_FAST,      /* The Kconfig profile */
+    BLE_LINK_IDLE,      /* Relaxed, with peripheral latency */
+    BLE_LINK_STATE_COUNT,
+};
+
+struct ble_link_stats {
+    uint64_t time_ms[BLE_LINK_STATE_COUNT];  /* Connected time per parameter set */
+    uint32_t switches;                       /* Parameter updates requested */
+    uint32_t deferred;                       /* Switches held back by the rate limit */
+};
+
+/* PHY and data length of the first link up, all zero once it is gone */
+struct ble_link_radio {
+    uint8_t tx_phy;          /* BT_GAP_LE_PHY_* */
+    uint8_t rx_phy;
+    uint16_t tx_max_len;     /* Octets per LL PDU payload */
+    uint16_t tx_max_time;    /* Microseconds */
+    uint16_t rx_max_len;
+    uint16_t rx_max_time;
+};
+
+void ble_link_init(void);
+
+/* Parameters to pass to bt_conn_le_create() */
+const struct bt_le_conn_param *ble_link_conn_param(void);
+
+/* Link encrypted - ask again for the profile if it was not granted */
+void ble_link_secured(struct bt_conn *conn);
+
+/*
+ * Link up or PHY updated, from the system workqueue: ask for 2M PHY the
+ * first time, then for the largest data length
+ */
+void ble_link_tune(struct bt_conn *conn);
+
+/* True if the connection's current parameters meet the profile */
+bool ble_link_profile_met(struct bt_conn *conn);
+
+/* Report received from any device. Cheap; called from the BT RX thread. */
+void ble_link_activity(void);
+
+/* Time spent in each parameter set since boot, current links included */
+void ble_link_get_stats(struct ble_link_stats *stats);
+
+/* PHY and data length negotiated on the first link up */
+void ble_link_get_radio(struct ble_link_radio *radio);
+
+#endif /* BLE_LINK_H_ */
@@ -0,0 +1,1113 @@
+/*
+ * Keyboard connection manager
+ *
+ * The Bluetooth callbacks only queue an event and submit a work item; every
+ * state transition runs on the system workqueue. The retry timer is a
+ * delayable work item on the same queue, so the state is only ever changed
+ * from one thread and nothing here waits inside the stack.
+ *
+ *   search: IDLE -> SCANNING / CONNECTING
+ *   link:   SECURING -> DISCOVERING -> STREAMING
+ *
+ * The search runs while fewer than CONFIG_BRIDGE_MAX_DEVICES links are up
+ * and some known device is not connected; every link then goes through its
+ * own states. Any failure on the way drops the search to BACKOFF, which
+ * retries after a delay that doubles with every failed attempt. A link lost
+ * while streaming is searched for at once, as the device normally just went
+ * out of range or to sleep.
+ *
+ * Looking for the keyboard, by name or by auto-connect to a bonded one,
+ * starts with a fast burst (CONFIG_BRIDGE_SCAN_BURST_MS) that catches a
+ * keyboard waking up, then drops to a low duty cycle, and gives up after
+ * CONFIG_BRIDGE_SCAN_TIMEOUT seconds. Once a keyboard has been seen with
+ * its name in the advertisement itself, name scans are passive.
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/hci.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/settings/settings.h>
+
+#include "conn_mgr.h"
+#include "adv_match.h"
+#include "ble_link.h"
+#include "hids_client.h"
+#include "persist.h"
+#include "profiles.h"
+
+LOG_MODULE_DECLARE(ble_bridge, LOG_LEVEL_INF);
+
+BUILD_ASSERT(CONFIG_BRIDGE_RECONNECT_BACKOFF_MIN_MS <= CONFIG_BRIDGE_RECONNECT_BACKOFF_MAX_MS,
+             "BRIDGE_RECONNECT_BACKOFF_MIN_MS must not exceed BRIDGE_RECONNECT_BACKOFF_MAX_MS");
+BUILD_ASSERT(CONFIG_BRIDGE_SCAN_SLOW_WINDOW <= CONFIG_BRIDGE_SCAN_SLOW_INTERVAL,
+             "BRIDGE_SCAN_SLOW_WINDOW must not exceed BRIDGE_SCAN_SLOW_INTERVAL");
+BUILD_ASSERT(CONFIG_BRIDGE_MAX_DEVICES <= CONFIG_BT_MAX_CONN,
+             "BRIDGE_MAX_DEVICES needs as many BT_MAX_CONN");
+
+enum conn_mgr_event_type {
+    CONN_MGR_EVT_START,
+    CONN_MGR_EVT_CONNECTED,     /* err: HCI status */
+    CONN_MGR_EVT_DISCONNECTED,  /* err: HCI reason */
+    CONN_MGR_EVT_SECURED,       /* err: bt_security_err, level */
+    CONN_MGR_EVT_BONDED,        /* addr: identity address */
+    CONN_MGR_EVT_READY,         /* err: errno from the HID client */
+    CONN_MGR_EVT_RECONNECT,
+    CONN_MGR_EVT_SWITCH,        /* slot: profile, PROFILE_NONE for the next one */
+    CONN_MGR_EVT_FORGET,        /* slot: profile, PROFILE_NONE for all */
+    CONN_MGR_EVT_PHY_UPDATED,
+};
+
+struct conn_mgr_event {
+    enum conn_mgr_event_type type;
+    int err;
+    uint8_t level;
+    uint8_t slot;
+    struct bt_conn *conn;       /* Reference held while queued, or NULL */
+    bt_addr_le_t addr;
+};
+
+#define CONN_MGR_EVENT_QUEUE_DEPTH 8
+
+/*
+ * Connects and disconnects have a queue of their own that cannot fill up:
+ * a queued event holds its connection, so the object cannot be reused and
+ * each one has at most one of each outstanding.
+ */
+#define CONN_MGR_LINK_QUEUE_DEPTH (2 * CONFIG_BT_MAX_CONN)
+
+K_MSGQ_DEFINE(mgr_events, sizeof(struct conn_mgr_event), CONN_MGR_EVENT_QUEUE_DEPTH, 4);
+K_MSGQ_DEFINE(link_events, sizeof(struct conn_mgr_event), CONN_MGR_LINK_QUEUE_DEPTH, 4);
+
+static const char *const state_names[] = {
+    [CONN_MGR_IDLE] = "idle",
+    [CONN_MGR_SCANNING] = "scanning",
+    [CONN_MGR_CONNECTING] = "connecting",
+    [CONN_MGR_SECURING] = "securing",
+    [CONN_MGR_DISCOVERING] = "discovering",
+    [CONN_MGR_STREAMING] = "streaming",
+    [CONN_MGR_BACKOFF] = "backoff",
+};
+
+/* Scan interval and window, in 0.625 ms units */
+struct scan_duty {
+    uint16_t interval;
+    uint16_t window;
+};
+
+static const struct scan_duty scan_burst = {
+    BT_GAP_SCAN_FAST_INTERVAL, BT_GAP_SCAN_FAST_WINDOW,
+};
+static const struct scan_duty scan_slow = {
+    CONFIG_BRIDGE_SCAN_SLOW_INTERVAL, CONFIG_BRIDGE_SCAN_SLOW_WINDOW,
+};
+
+#define SCAN_TIMEOUT_MS ((int64_t)CONFIG_BRIDGE_SCAN_TIMEOUT * MSEC_PER_SEC)
+
+static const struct conn_mgr_cb *mgr_cb;
+static struct k_work event_work;
+static struct k_work_delayable retry_work;
+static struct k_work_delayable search_work;     /* Next step of the scan schedule */
+static struct k_work_delayable rank_work;       /* End of the candidate window */
+
+/* One entry per link, at the connection's index */
+struct mgr_link {
+    struct bt_conn *conn;           /* Guarded by mgr_lock */
+    enum conn_mgr_state state;      /* SECURING, DISCOVERING or STREAMING */
+    uint8_t profile;                /* Slot in the profile table, or PROFILE_NONE */
+    struct k_work_delayable secure_timeout;
+};
+
+static struct k_spinlock mgr_lock;
+static struct mgr_link links[CONFIG_BT_MAX_CONN];
+static uint8_t link_count;                  /* Guarded by mgr_lock */
+static enum conn_mgr_state mgr_state;       /* Search state, changed on the workqueue only */
+static struct bt_conn *mgr_pending;         /* Direct connection being created */
+static bool mgr_pairing;                    /* Scanning for one more device to pair */
+static bt_addr_le_t mgr_target;             /* Stored keyboard being switched to */
+static bool mgr_targeted;
+static uint8_t mgr_last_profile = PROFILE_NONE;  /* Profile of the latest link */
+static uint32_t backoff_ms = CONFIG_BRIDGE_RECONNECT_BACKOFF_MIN_MS;
+static int64_t search_since;                /* Uptime the current search started */
+static uint8_t scan_passive;                /* Name is in the advertisement, saved as ble_bridge/scan */
+
+static void conn_mgr_queue(struct conn_mgr_event *evt)
+{
+    bool lifecycle = (evt->type == CONN_MGR_EVT_CONNECTED ||
+                      evt->type == CONN_MGR_EVT_DISCONNECTED);
+
+    if (k_msgq_put(lifecycle ? &link_events : &mgr_events, evt, K_NO_WAIT)) {
+        LOG_ERR("Connection event %d dropped, queue full", evt->type);
+        if (evt->conn) {
+            bt_conn_unref(evt->conn);
+        }
+        return;
+    }
+
+    k_work_submit(&event_work);
+}
+
+static void conn_mgr_post(enum conn_mgr_event_type type, struct bt_conn *conn,
+                          int err, const bt_addr_le_t *addr)
+{
+    struct conn_mgr_event evt = {
+        .type = type,
+        .err = err,
+        .conn = conn ? bt_conn_ref(conn) : NULL,
+    };
+
+    if (addr) {
+        bt_addr_le_copy(&evt.addr, addr);
+    }
+
+    conn_mgr_queue(&evt);
+}
+
+static void conn_mgr_enter(enum conn_mgr_state state)
+{
+    if (state != mgr_state) {
+        LOG_DBG("Search %s -> %s", state_names[mgr_state], state_names[state]);
+        mgr_state = state;
+    }
+}
+
+static struct mgr_link *conn_mgr_link(struct bt_conn *conn)
+{
+    struct mgr_link *link = &links[bt_conn_index(conn)];
+
+    return (link->conn == conn) ? link : NULL;
+}
+
+static void conn_mgr_link_enter(struct mgr_link *link, enum conn_mgr_state state)
+{
+    LOG_DBG("Link %u %s -> %s", (unsigned int)(link - links),
+            state_names[link->state], state_names[state]);
+    link->state = state;
+}
+
+static bool conn_mgr_full(void)
+{
+    return link_count >= CONFIG_BRIDGE_MAX_DEVICES;
+}
+
+static bool conn_mgr_peer_connected(const bt_addr_le_t *addr)
+{
+    struct bt_conn *conn = bt_conn_lookup_addr_le(BT_ID_DEFAULT, addr);
+
+    if (!conn) {
+        return false;
+    }
+    bt_conn_unref(conn);
+    return true;
+}
+
+static void conn_mgr_search_stop(void)
+{
+    k_work_cancel_delayable(&search_work);
+    bt_le_scan_stop();
+    bt_conn_create_auto_stop();
+}
+
+/* Retry after the current backoff, and wait twice as long next time */
+static void conn_mgr_backoff(void)
+{
+    LOG_INF("Retrying in %u ms", backoff_ms);
+    conn_mgr_search_stop();
+    conn_mgr_enter(CONN_MGR_BACKOFF);
+    k_work_reschedule(&retry_work, K_MSEC(backoff_ms));
+    backoff_ms = MIN(backoff_ms * 2, CONFIG_BRIDGE_RECONNECT_BACKOFF_MAX_MS);
+}
+
+/* BLE Scanning - BT RX thread, the first match opens the candidate window */
+static void scan_cb(const bt_addr_le_t *addr, int8_t rssi, uint8_t type,
+                    struct net_buf_simple *ad)
+{
+    if (adv_match_offer(addr, rssi, type, ad)) {
+        k_work_schedule(&rank_work, K_MSEC(CONFIG_BRIDGE_MATCH_WINDOW_MS));
+    }
+}
+
+static void conn_mgr_scan(const struct scan_duty *duty)
+{
+    struct bt_le_scan_param scan_param = {
+        .type       = scan_passive ? BT_LE_SCAN_TYPE_PASSIVE : BT_LE_SCAN_TYPE_ACTIVE,
+        .options    = BT_LE_SCAN_OPT_NONE,
+        .interval   = duty->interval,
+        .window     = duty->window,
+    };
+    int err;
+
+    /* Looking for a new keyboard: hand the scanner back from auto-connect */
+    bt_conn_create_auto_stop();
+    /* Parameters only change on a restart */
+    bt_le_scan_stop();
+    adv_match_reset();
+
+    err = bt_le_scan_start(&scan_param, scan_cb);
+    if (err) {
+        LOG_ERR("Scanning failed to start (err %d)", err);
+        conn_mgr_backoff();
+        return;
+    }
+
+    conn_mgr_enter(CONN_MGR_SCANNING);
+    LOG_INF("Scanning for Kinesis keyboard (%s, %s)...",
+            duty == &scan_burst ? "fast" : "slow",
+            scan_passive ? "passive" : "active");
+}
+
+/* Direct connection, given up by the stack after CONFIG_BT_CREATE_CONN_TIMEOUT */
+static void conn_mgr_create(const bt_addr_le_t *addr)
+{
+    int err;
+
+    mgr_pending = NULL;
+    err = bt_conn_le_create(addr, BT_CONN_LE_CREATE_CONN, ble_link_conn_param(),
+                            &mgr_pending);
+    if (err) {
+        LOG_ERR("Create connection failed (err %d)", err);
+        conn_mgr_backoff();
+        return;
+    }
+
+    conn_mgr_enter(CONN_MGR_CONNECTING);
+}
+
+/*
+ * Bonded keyboards go into the controller's filter accept list. Their IRKs
+ * are already in the resolving list (the host adds them with the bond), so
+ * the controller matches the keyboard's rotating private address itself.
+ */
+static void accept_list_add_bond(const struct bt_bond_info *info, void *user_data)
+{
+    uint8_t *count = user_data;
+    int err;
+
+    /* Already linked; it is not advertising to us */
+    if (conn_mgr_peer_connected(&info->addr)) {
+        return;
+    }
+
+    err = bt_le_filter_accept_list_add(&info->addr);
+    if (err) {
+        LOG_WRN("Accept list add failed (err %d)", err);
+        return;
+    }
+    (*count)++;
+}
+
+static uint8_t accept_list_load(void)
+{
+    uint8_t count = 0;
+
+    /* The list cannot change while the controller is initiating from it */
+    bt_conn_create_auto_stop();
+
+    int err = bt_le_filter_accept_list_clear();
+    if (err) {
+        LOG_WRN("Accept list clear failed (err %d)", err);
+        return 0;
+    }
+
+    if (!mgr_targeted) {
+        bt_foreach_bond(BT_ID_DEFAULT, accept_list_add_bond, &count);
+    } else if (bt_le_bond_exists(BT_ID_DEFAULT, &mgr_target)) {
+        /* Switching: only the chosen keyboard */
+        struct bt_bond_info target = { .addr = mgr_target };
+
+        accept_list_add_bond(&target, &count);
+    }
+    LOG_DBG("%u bonded device(s) in the accept list", count);
+
+    return count;
+}
+
+/*
+ * Keyboard to connect to by address: the one being switched to, or the
+ * most recently used one stored without a bond
+ */
+static bool conn_mgr_direct_peer(bt_addr_le_t *addr)
+{
+    struct profile prof;
+    uint32_t newest = 0;
+
+    if (mgr_targeted) {
+        bt_addr_le_copy(addr, &mgr_target);
+        return !conn_mgr_peer_connected(addr);
+    }
+
+    for (uint8_t slot = 0; slot < CONFIG_BRIDGE_PROFILE_SLOTS; slot++) {
+        if (profiles_get(slot, &prof) || prof.bonded || prof.last_used < newest ||
+            conn_mgr_peer_connected(&prof.addr)) {
+            continue;
+        }
+        bt_addr_le_copy(addr, &prof.addr);
+        newest = prof.last_used;
+    }
+
+    return newest != 0;
+}
+
+static void conn_mgr_connect(const struct scan_duty *duty)
+{
+    bt_addr_le_t addr;
+    int err;
+
+    /* Auto-connect owns the scanner */
+    bt_le_scan_stop();
+
+    /*
+     * Let the controller connect on the first advertisement from any bonded
+     * device not linked yet; nothing else reaches the host.
+     */
+    if (accept_list_load()) {
+        err = bt_conn_le_create_auto(BT_CONN_LE_CREATE_PARAM(BT_CONN_LE_OPT_NONE,
+                                                             duty->interval,
+                                                             duty->window),
+                                     ble_link_conn_param());
+        if (!err || err == -EALREADY) {
+            LOG_INF("Waiting for bonded keyboard to advertise");
+            conn_mgr_enter(CONN_MGR_CONNECTING);
+            return;
+        }
+        LOG_ERR("Auto-connect failed (err %d), trying direct connection", err);
+    }
+
+    if (!conn_mgr_direct_peer(&addr)) {
+        LOG_INF("All known devices connected");
+        mgr_targeted = false;
+        conn_mgr_search_stop();
+        conn_mgr_enter(CONN_MGR_IDLE);
+        return;
+    }
+
+    /* Saved keyboard without a bond: identity address is all we have */
+    LOG_INF("Attempting direct reconnection to saved keyboard");
+    conn_mgr_create(&addr);
+}
+
+/* Start the scan schedule over, on boot, link loss or request */
+static void conn_mgr_search_begin(void)
+{
+    search_since = k_uptime_get();
+}
+
+/*
+ * Reconnect to the known devices not linked yet, or look for a new one, at
+ * the duty cycle for the time searched so far. Called again on every step
+ * of the schedule and whenever a link comes up.
+ */
+static void conn_mgr_search(void)
+{
+    int64_t elapsed = k_uptime_get() - search_since;
+    int64_t next = INT64_MAX;
+
+    if (conn_mgr_full()) {
+        LOG_DBG("All %u device slots in use", CONFIG_BRIDGE_MAX_DEVICES);
+        mgr_pairing = false;
+        conn_mgr_search_stop();
+        conn_mgr_enter(CONN_MGR_IDLE);
+        return;
+    }
+
+    /* Looking for another device gets one burst, then the known ones again */
+    if (mgr_pairing && elapsed >= CONFIG_BRIDGE_SCAN_BURST_MS) {
+        LOG_INF("No new device found");
+        mgr_pairing = false;
+        conn_mgr_search_begin();
+        elapsed = 0;
+    }
+
+    if (CONFIG_BRIDGE_SCAN_TIMEOUT && elapsed >= SCAN_TIMEOUT_MS) {
+        LOG_WRN("Search ended after %u s, press the button to search again",
+                CONFIG_BRIDGE_SCAN_TIMEOUT);
+        conn_mgr_search_stop();
+        if ((!profiles_count() || mgr_pairing) && scan_passive) {
+            /* The name may have moved to the scan response */
+            scan_passive = 0;
+            persist_save("ble_bridge/scan", &scan_passive, sizeof(scan_passive));
+        }
+        mgr_pairing = false;
+        mgr_targeted = false;
+        conn_mgr_enter(CONN_MGR_IDLE);
+        return;
+    }
+
+    if (elapsed < CONFIG_BRIDGE_SCAN_BURST_MS) {
+        next = CONFIG_BRIDGE_SCAN_BURST_MS;
+    }
+    if (CONFIG_BRIDGE_SCAN_TIMEOUT) {
+        next = MIN(next, SCAN_TIMEOUT_MS);
+    }
+    if (next != INT64_MAX) {
+        k_work_reschedule(&search_work, K_MSEC(next - elapsed));
+    }
+
+    const struct scan_duty *duty = elapsed < CONFIG_BRIDGE_SCAN_BURST_MS ?
+                                   &scan_burst : &scan_slow;
+
+    if (profiles_count() && !mgr_pairing) {
+        conn_mgr_connect(duty);
+    } else {
+        conn_mgr_scan(duty);
+    }
+}
+
+static void conn_mgr_discover(struct mgr_link *link)
+{
+    int err = hids_client_discover(link->conn);
+
+    if (err) {
+        LOG_ERR("Discover failed (err %d), dropping link", err);
+        bt_conn_disconnect(link->conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+        return;
+    }
+
+    conn_mgr_link_enter(link, CONN_MGR_DISCOVERING);
+}
+
+/* Candidate window over - connect to the closest keyboard */
+static void rank_work_handler(struct k_work *work)
+{
+    struct adv_match_candidate best;
+    char addr[BT_ADDR_LE_STR_LEN];
+    int err;
+
+    if (mgr_state != CONN_MGR_SCANNING || !adv_match_pick(&best)) {
+        return;
+    }
+
+    bt_addr_le_to_str(&best.addr, addr, sizeof(addr));
+    LOG_INF("Found Kinesis keyboard %s, RSSI %d (%u candidates)", addr,
+            best.rssi, best.count);
+
+    /* Name in the advertisement itself: no need for scan requests next time */
+    if (best.in_adv != scan_passive) {
+        scan_passive = best.in_adv;
+        persist_save("ble_bridge/scan", &scan_passive, sizeof(scan_passive));
+    }
+
+    /* Stop scanning and connect */
+    err = bt_le_scan_stop();
+    if (err) {
+        LOG_ERR("Stop scan failed (err %d)", err);
+        conn_mgr_backoff();
+        return;
+    }
+
+    k_work_cancel_delayable(&search_work);
+    conn_mgr_create(&best.addr);
+}
+
+static void conn_mgr_on_connected(struct bt_conn *conn, uint8_t err)
+{
+    char addr[BT_ADDR_LE_STR_LEN];
+    struct mgr_link *link = &links[bt_conn_index(conn)];
+
+    if (mgr_pending) {
+        bt_conn_unref(mgr_pending);
+        mgr_pending = NULL;
+    }
+
+    bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+
+    if (err) {
+        LOG_ERR("Failed to connect to %s (%u)", addr, err);
+        /* A cancelled attempt has already been replaced by something else */
+        if (mgr_state == CONN_MGR_CONNECTING) {
+            conn_mgr_backoff();
+        }
+        return;
+    }
+
+    if (conn_mgr_full()) {
+        LOG_WRN("No free device slot for %s, disconnecting", addr);
+        bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+        return;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&mgr_lock);
+    link->conn = bt_conn_ref(conn);
+    link_count++;
+    k_spin_unlock(&mgr_lock, key);
+
+    LOG_INF("Connected: %s (%u of %u devices)", addr, link_count,
+            CONFIG_BRIDGE_MAX_DEVICES);
+    mgr_pairing = false;
+    if (mgr_targeted && bt_addr_le_eq(bt_conn_get_dst(conn), &mgr_target)) {
+        mgr_targeted = false;
+    }
+
+    /* 2M PHY and long PDUs */
+    ble_link_tune(conn);
+
+    /* Store the keyboard for reconnection, or mark it most recently used */
+    link->profile = profiles_use(bt_conn_get_dst(conn));
+    mgr_last_profile = link->profile;
+
+    /* Bonded keyboard: take notifications as soon as the link is encrypted */
+    if (!hids_client_resume(conn)) {
+        LOG_INF("Subscriptions restored from saved handles");
+    }
+
+    /* Set security level for encrypted connection */
+    int sec_err = bt_conn_set_security(conn, BT_SECURITY_L2);
+    if (sec_err) {
+        LOG_WRN("Failed to set security level: %d", sec_err);
+        /* Continue anyway - keyboard might not require encryption */
+        conn_mgr_discover(link);
+    } else {
+        LOG_INF("Security level set to L2 (encrypted) - waiting for security");
+        /* Discovery starts once the link is encrypted */
+        conn_mgr_link_enter(link, CONN_MGR_SECURING);
+        k_work_reschedule(&link->secure_timeout,
+                          K_MSEC(CONFIG_BRIDGE_SECURITY_TIMEOUT_MS));
+    }
+
+    /* Keep looking for the other known devices while slots are free */
+    conn_mgr_search();
+}
+
+static void conn_mgr_on_disconnected(struct bt_conn *conn, uint8_t reason)
+{
+    char addr[BT_ADDR_LE_STR_LEN];
+    struct mgr_link *link = conn_mgr_link(conn);
+    bool was_streaming;
+
+    if (!link) {
+        return;
+    }
+
+    was_streaming = (link->state == CONN_MGR_STREAMING);
+    bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+    LOG_INF("Disconnected: %s (reason %u)", addr, reason);
+
+    k_spinlock_key_t key = k_spin_lock(&mgr_lock);
+    link->conn = NULL;
+    link_count--;
+    k_spin_unlock(&mgr_lock, key);
+    conn_mgr_link_enter(link, CONN_MGR_IDLE);
+    k_work_cancel_delayable(&link->secure_timeout);
+
+    /* Clear discovery state, then release what this device was holding */
+    hids_client_reset(conn);
+    if (mgr_cb->disconnected) {
+        mgr_cb->disconnected(bt_conn_index(conn));
+    }
+    bt_conn_unref(conn);
+
+    if (!profiles_count()) {
+        /* Devices were forgotten, scan once the last link is gone */
+        if (!link_count) {
+            conn_mgr_search_begin();
+            conn_mgr_search();
+        }
+        return;
+    }
+
+    if (!IS_ENABLED(CONFIG_BRIDGE_AUTO_RECONNECT) && !mgr_targeted) {
+        LOG_INF("Auto-reconnect disabled, press the button to reconnect");
+        return;
+    }
+
+    /* A scan or connection under way searches again once it is done */
+    if (mgr_state == CONN_MGR_SCANNING || mgr_pending) {
+        return;
+    }
+
+    conn_mgr_search_begin();
+
+    if (was_streaming) {
+        LOG_INF("Attempting to reconnect to %s", addr);
+        backoff_ms = CONFIG_BRIDGE_RECONNECT_BACKOFF_MIN_MS;
+        conn_mgr_search();
+    } else {
+        conn_mgr_backoff();
+    }
+}
+
+static void conn_mgr_on_secured(struct bt_conn *conn, uint8_t level, int err)
+{
+    char addr[BT_ADDR_LE_STR_LEN];
+    struct mgr_link *link = conn_mgr_link(conn);
+
+    if (!link) {
+        return;
+    }
+
+    bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+
+    if (err) {
+        LOG_ERR("Security failed: %s level %u err %d, dropping link", addr,
+                level, err);
+        /* The disconnect backs off before the next attempt */
+        bt_conn_disconnect(conn, BT_HCI_ERR_AUTH_FAIL);
+
+        /* The keyboard lost its bond: pair again from scratch next time */
+        if (err == BT_SECURITY_ERR_PIN_OR_KEY_MISSING) {
+            LOG_WRN("Keyboard has no key for %s, dropping the bond", addr);
+            profiles_forget(link->profile);
+            bt_unpair(BT_ID_DEFAULT, bt_conn_get_dst(conn));
+            link->profile = PROFILE_NONE;
+        }
+        return;
+    }
+
+    LOG_INF("Security changed: %s level %u", addr, level);
+
+    if (level >= BT_SECURITY_L2) {
+        k_work_cancel_delayable(&link->secure_timeout);
+    }
+
+    /* Peripherals often only accept a parameter update once encrypted */
+    ble_link_secured(conn);
+
+    /* If we just established security and haven't started discovery yet, do it now */
+    if (level >= BT_SECURITY_L2 && !hids_client_active(conn)) {
+        LOG_INF("Security established, starting HID service discovery");
+        conn_mgr_discover(link);
+    }
+}
+
+static void conn_mgr_on_ready(struct bt_conn *conn, int err)
+{
+    struct mgr_link *link = conn_mgr_link(conn);
+
+    if (!link) {
+        return;
+    }
+
+    if (err) {
+        LOG_ERR("HID service unusable (err %d), dropping link", err);
+        bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+        return;
+    }
+
+    backoff_ms = CONFIG_BRIDGE_RECONNECT_BACKOFF_MIN_MS;
+    conn_mgr_link_enter(link, CONN_MGR_STREAMING);
+
+    struct bt_conn_info info;
+
+    if (!bt_conn_get_info(conn, &info)) {
+        profiles_params(link->profile, info.le.interval, info.le.latency,
+                        info.le.timeout);
+    }
+}
+
+static void conn_mgr_on_phy_updated(struct bt_conn *conn)
+{
+    if (conn_mgr_link(conn)) {
+        ble_link_tune(conn);
+    }
+}
+
+static void conn_mgr_on_bonded(struct bt_conn *conn, const bt_addr_le_t *identity)
+{
+    struct mgr_link *link = conn_mgr_link(conn);
+
+    if (link) {
+        profiles_bonded(link->profile, identity);
+    }
+}
+
+static void forget_bond(const struct bt_bond_info *info, void *user_data)
+{
+    hids_client_forget(&info->addr);
+}
+
+static void conn_mgr_forget_all(void)
+{
+    LOG_INF("Clearing all pairings");
+
+    k_work_cancel_delayable(&retry_work);
+    backoff_ms = CONFIG_BRIDGE_RECONNECT_BACKOFF_MIN_MS;
+    mgr_pairing = false;
+    mgr_targeted = false;
+    conn_mgr_search_stop();
+
+    for (uint8_t i = 0; i < ARRAY_SIZE(links); i++) {
+        if (links[i].conn) {
+            bt_conn_disconnect(links[i].conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+        }
+    }
+    if (mgr_pending) {
+        /* Cancels the connection being created */
+        bt_conn_disconnect(mgr_pending, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+    }
+
+    /* Clear the profiles, any other bond and their GATT handles */
+    bt_foreach_bond(BT_ID_DEFAULT, forget_bond, NULL);
+    profiles_clear();
+    bt_unpair(BT_ID_DEFAULT, NULL);
+
+    /* With links up, the scan starts once the last one is gone */
+    if (!link_count) {
+        conn_mgr_search_begin();
+        conn_mgr_search();
+    }
+}
+
+static void conn_mgr_on_forget(uint8_t slot)
+{
+    struct profile prof;
+    char addr[BT_ADDR_LE_STR_LEN];
+
+    if (slot == PROFILE_NONE) {
+        conn_mgr_forget_all();
+        return;
+    }
+
+    if (profiles_get(slot, &prof)) {
+        return;
+    }
+
+    bt_addr_le_to_str(&prof.addr, addr, sizeof(addr));
+    LOG_INF("Forgetting profile %u: %s", slot, addr);
+
+    if (mgr_targeted && bt_addr_le_eq(&prof.addr, &mgr_target)) {
+        mgr_targeted = false;
+    }
+
+    for (uint8_t i = 0; i < ARRAY_SIZE(links); i++) {
+        if (links[i].conn && links[i].profile == slot) {
+            bt_conn_disconnect(links[i].conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+        }
+    }
+    profiles_forget(slot);
+}
+
+/* Link whose keyboard was used least recently */
+static struct mgr_link *conn_mgr_lru_link(void)
+{
+    struct mgr_link *lru = NULL;
+    uint32_t oldest = UINT32_MAX;
+    struct profile prof;
+
+    for (uint8_t i = 0; i < ARRAY_SIZE(links); i++) {
+        uint32_t used;
+
+        if (!links[i].conn) {
+            continue;
+        }
+        used = profiles_get(links[i].profile, &prof) ? 0 : prof.last_used;
+        if (!lru || used < oldest) {
+            lru = &links[i];
+            oldest = used;
+        }
+    }
+
+    return lru;
+}
+
+/* Stored keyboard after the latest one that is not connected */
+static uint8_t conn_mgr_next_profile(void)
+{
+    uint8_t slot = mgr_last_profile;
+    struct profile prof;
+
+    for (uint8_t i = 0; i < CONFIG_BRIDGE_PROFILE_SLOTS; i++) {
+        slot = profiles_next(slot);
+        if (slot == PROFILE_NONE) {
+            break;
+        }
+        if (!profiles_get(slot, &prof) && !conn_mgr_peer_connected(&prof.addr)) {
+            return slot;
+        }
+    }
+
+    return PROFILE_NONE;
+}
+
+/*
+ * Connect to a stored keyboard without a scan: the controller looks for it
+ * alone, from the accept list, at the burst duty cycle. With every slot in
+ * use the least recently used link makes room first.
+ */
+static void conn_mgr_on_switch(uint8_t slot)
+{
+    char addr[BT_ADDR_LE_STR_LEN];
+    struct profile prof;
+
+    if (slot == PROFILE_NONE) {
+        slot = conn_mgr_next_profile();
+    }
+    if (profiles_get(slot, &prof)) {
+        LOG_INF("No other stored keyboard to switch to");
+        return;
+    }
+
+    bt_addr_le_to_str(&prof.addr, addr, sizeof(addr));
+    if (conn_mgr_peer_connected(&prof.addr)) {
+        LOG_INF("Profile %u (%s) already connected", slot, addr);
+        return;
+    }
+
+    LOG_INF("Switching to profile %u: %s, last interval %u latency %u", slot,
+            addr, prof.interval, prof.latency);
+
+    bt_addr_le_copy(&mgr_target, &prof.addr);
+    mgr_targeted = true;
+    mgr_pairing = false;
+    k_work_cancel_delayable(&retry_work);
+    backoff_ms = CONFIG_BRIDGE_RECONNECT_BACKOFF_MIN_MS;
+
+    if (conn_mgr_full()) {
+        /* The search starts once the link is gone */
+        bt_conn_disconnect(conn_mgr_lru_link()->conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+        return;
+    }
+
+    /* A connection being created searches again once it is done */
+    if (mgr_pending) {
+        return;
+    }
+
+    conn_mgr_search_begin();
+    conn_mgr_search();
+}
+
+/*
+ * Button: retry now, or search again after a timeout. With devices linked
+ * and a slot free, look for one more device to pair instead.
+ */
+static void conn_mgr_on_reconnect(void)
+{
+    if (mgr_pending || conn_mgr_full()) {
+        LOG_DBG("Nothing to reconnect in state %s", state_names[mgr_state]);
+        return;
+    }
+
+    if (link_count) {
+        LOG_INF("Looking for another device to pair");
+        mgr_pairing = true;
+    }
+
+    k_work_cancel_delayable(&retry_work);
+    backoff_ms = CONFIG_BRIDGE_RECONNECT_BACKOFF_MIN_MS;
+    conn_mgr_search_begin();
+    conn_mgr_search();
+}
+
+static int scan_passive_load_cb(const char *key, size_t len,
+                                settings_read_cb read_cb, void *cb_arg,
+                                void *param)
+{
+    if (len == sizeof(scan_passive)) {
+        read_cb(cb_arg, &scan_passive, sizeof(scan_passive));
+    }
+    return 0;
+}
+
+/* Have the keyboard most likely to come back first ready to resume */
+static void conn_mgr_preload(void)
+{
+    struct profile prof;
+    struct profile latest = {0};
+
+    for (uint8_t slot = 0; slot < CONFIG_BRIDGE_PROFILE_SLOTS; slot++) {
+        if (!profiles_get(slot, &prof) && prof.bonded &&
+            prof.last_used > latest.last_used) {
+            latest = prof;
+        }
+    }
+
+    if (latest.last_used) {
+        hids_client_preload(&latest.addr);
+    }
+}
+
+static void conn_mgr_on_start(void)
+{
+    profiles_load();
+    conn_mgr_preload();
+    settings_load_subtree_direct("ble_bridge/scan", scan_passive_load_cb, NULL);
+    conn_mgr_search_begin();
+    conn_mgr_search();
+}
+
+static void conn_mgr_handle(const struct conn_mgr_event *evt)
+{
+    switch (evt->type) {
+    case CONN_MGR_EVT_START:
+        conn_mgr_on_start();
+        break;
+    case CONN_MGR_EVT_CONNECTED:
+        conn_mgr_on_connected(evt->conn, evt->err);
+        break;
+    case CONN_MGR_EVT_DISCONNECTED:
+        conn_mgr_on_disconnected(evt->conn, evt->err);
+        break;
+    case CONN_MGR_EVT_SECURED:
+        conn_mgr_on_secured(evt->conn, evt->level, evt->err);
+        break;
+    case CONN_MGR_EVT_BONDED:
+        conn_mgr_on_bonded(evt->conn, &evt->addr);
+        break;
+    case CONN_MGR_EVT_READY:
+        conn_mgr_on_ready(evt->conn, evt->err);
+        break;
+    case CONN_MGR_EVT_RECONNECT:
+        conn_mgr_on_reconnect();
+        break;
+    case CONN_MGR_EVT_SWITCH:
+        conn_mgr_on_switch(evt->slot);
+        break;
+    case CONN_MGR_EVT_FORGET:
+        conn_mgr_on_forget(evt->slot);
+        break;
+    case CONN_MGR_EVT_PHY_UPDATED:
+        conn_mgr_on_phy_updated(evt->conn);
+        break;
+    }
+}
+
+static void event_work_handler(struct k_work *work)
+{
+    struct conn_mgr_event evt;
+
+    /* Connects and disconnects first, so later events find their link */
+    while (!k_msgq_get(&link_events, &evt, K_NO_WAIT) ||
+           !k_msgq_get(&mgr_events, &evt, K_NO_WAIT)) {
+        conn_mgr_handle(&evt);
+        if (evt.conn) {
+            bt_conn_unref(evt.conn);
+        }
+    }
+}
+
+/* Link never reached the security level asked for */
+static void secure_timeout_handler(struct k_work *work)
+{
+    struct mgr_link *link = CONTAINER_OF(k_work_delayable_from_work(work),
+                                         struct mgr_link, secure_timeout);
+
+    if (link->conn && link->state == CONN_MGR_SECURING) {
+        LOG_ERR("Link %u not encrypted after %u ms, dropping it",
+                (unsigned int)(link - links), CONFIG_BRIDGE_SECURITY_TIMEOUT_MS);
+        bt_conn_disconnect(link->conn, BT_HCI_ERR_AUTH_FAIL);
+    }
+}
+
+static void retry_work_handler(struct k_work *work)
+{
+    if (mgr_state == CONN_MGR_BACKOFF) {
+        conn_mgr_search();
+    }
+}
+
+/* Burst over or search timed out; a pending retry picks up the new step */
+static void search_work_handler(struct k_work *work)
+{
+    if (mgr_state == CONN_MGR_SCANNING ||
+        (mgr_state == CONN_MGR_CONNECTING && !mgr_pending)) {
+        conn_mgr_search();
+    }
+}
+
+void conn_mgr_init(const struct conn_mgr_cb *cb)
+{
+    mgr_cb = cb;
+    k_work_init(&event_work, event_work_handler);
+    k_work_init_delayable(&retry_work, retry_work_handler);
+    k_work_init_delayable(&search_work, search_work_handler);
+    k_work_init_delayable(&rank_work, rank_work_handler);
+    for (uint8_t i = 0; i < ARRAY_SIZE(links); i++) {
+        k_work_init_delayable(&links[i].secure_timeout, secure_timeout_handler);
+    }
+}
+
+void conn_mgr_start(void)
+{
+    conn_mgr_post(CONN_MGR_EVT_START, NULL, 0, NULL);
+}
+
+void conn_mgr_reconnect(void)
+{
+    conn_mgr_post(CONN_MGR_EVT_RECONNECT, NULL, 0, NULL);
+}
+
+static void conn_mgr_post_slot(enum conn_mgr_event_type type, uint8_t slot)
+{
+    struct conn_mgr_event evt = {
+        .type = type,
+        .slot = slot,
+    };
+
+    conn_mgr_queue(&evt);
+}
+
+void conn_mgr_forget(void)
+{
+    conn_mgr_post_slot(CONN_MGR_EVT_FORGET, PROFILE_NONE);
+}
+
+void conn_mgr_forget_profile(uint8_t slot)
+{
+    conn_mgr_post_slot(CONN_MGR_EVT_FORGET, slot);
+}
+
+void conn_mgr_switch(uint8_t slot)
+{
+    conn_mgr_post_slot(CONN_MGR_EVT_SWITCH, slot);
+}
+
+void conn_mgr_switch_next(void)
+{
+    conn_mgr_post_slot(CONN_MGR_EVT_SWITCH, PROFILE_NONE);
+}
+
+void conn_mgr_bonded(struct bt_conn *conn)
+{
+    conn_mgr_post(CONN_MGR_EVT_BONDED, conn, 0, bt_conn_get_dst(conn));
+}
+
+void conn_mgr_ready(struct bt_conn *conn, int err)
+{
+    conn_mgr_post(CONN_MGR_EVT_READY, conn, err, NULL);
+}
+
+bool conn_mgr_connected(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&mgr_lock);
+    bool connected = (link_count > 0);
+
+    k_spin_unlock(&mgr_lock, key);
+    return connected;
+}
+
+/* Bluetooth callbacks - BT RX thread, only queue the event */
+static void connected(struct bt_conn *conn, uint8_t err)
+{
+    conn_mgr_post(CONN_MGR_EVT_CONNECTED, conn, err, NULL);
+}
+
+static void disconnected(struct bt_conn *conn, uint8_t reason)
+{
+    conn_mgr_post(CONN_MGR_EVT_DISCONNECTED, conn, reason, NULL);
+}
+
+static void security_changed(struct bt_conn *conn, bt_security_t level,
+                             enum bt_security_err err)
+{
+    struct conn_mgr_event evt = {
+        .type = CONN_MGR_EVT_SECURED,
+        .err = err,
+        .level = level,
+        .conn = bt_conn_ref(conn),
+    };
+
+    conn_mgr_queue(&evt);
+}
+
+static void phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *param)
+{
+    conn_mgr_post(CONN_MGR_EVT_PHY_UPDATED, conn, 0, NULL);
+}
+
+BT_CONN_CB_DEFINE(conn_mgr_callbacks) = {
+    .connected = connected,
+    .disconnected = disconnected,
+    .security_changed = security_changed,
+    .le_phy_updated = phy_updated,
+};
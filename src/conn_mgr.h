@@ -0,0 +1,70 @@
+/*
+ * Keyboard connection manager
+ *
+ * Owns the links to up to CONFIG_BRIDGE_MAX_DEVICES HID devices from scan
+ * to streaming. Bluetooth callbacks only queue events; the state machine
+ * runs on the system workqueue, so recovering a link never blocks the BT
+ * RX thread. Failed attempts are retried with exponential backoff
+ * (CONFIG_BRIDGE_RECONNECT_BACKOFF_*), a lost link only when
+ * CONFIG_BRIDGE_AUTO_RECONNECT is set. Searches scan fast at first, then
+ * at a low duty cycle, and end after CONFIG_BRIDGE_SCAN_TIMEOUT. Known
+ * keyboards come from the profile table (profiles.h).
+ */
+
+#ifndef CONN_MGR_H_
+#define CONN_MGR_H_
+
+#include <stdbool.h>
+#include <zephyr/bluetooth/conn.h>
+
+enum conn_mgr_state {
+    CONN_MGR_IDLE,          /* Nothing to do until asked */
+    CONN_MGR_SCANNING,      /* Looking for an unpaired keyboard by name */
+    CONN_MGR_CONNECTING,    /* Connection being created */
+    CONN_MGR_SECURING,      /* Link: connected, waiting for encryption */
+    CONN_MGR_DISCOVERING,   /* Link: encrypted, HID service discovery running */
+    CONN_MGR_STREAMING,     /* Link: reports flowing */
+    CONN_MGR_BACKOFF,       /* Waiting to retry */
+};
+
+struct conn_mgr_cb {
+    /*
+     * Link gone, from the system workqueue. source is its bt_conn_index(),
+     * as in hids_report.source.
+     */
+    void (*disconnected)(uint8_t source);
+};
+
+void conn_mgr_init(const struct conn_mgr_cb *cb);
+
+/* Reconnect to the bonded devices, or scan for one */
+void conn_mgr_start(void);
+
+/* Retry now, skipping any backoff; with devices linked, pair one more */
+void conn_mgr_reconnect(void);
+
+/* Drop every link, bond and profile, then scan for a new keyboard */
+void conn_mgr_forget(void);
+
+/* Drop one stored keyboard (profiles.h slot), disconnecting it if linked */
+void conn_mgr_forget_profile(uint8_t slot);
+
+/*
+ * Connect to a stored keyboard, disconnecting the least recently used
+ * link if every device slot is taken
+ */
+void conn_mgr_switch(uint8_t slot);
+
+/* Switch to the next stored keyboard that is not connected */
+void conn_mgr_switch_next(void);
+
+/* Pairing done; the identity address is the one to reconnect to */
+void conn_mgr_bonded(struct bt_conn *conn);
+
+/* HID client finished discovery or verification (hids_client_cb.ready) */
+void conn_mgr_ready(struct bt_conn *conn, int err);
+
+/* True while at least one link is up */
+bool conn_mgr_connected(void);
+
+#endif /* CONN_MGR_H_ */
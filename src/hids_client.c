@@ -0,0 +1,1257 @@
+/*
+ * HID over GATT client
+ *
+ * Discovery runs as a chain of GATT procedures, each started from the
+ * completion of the previous one, all bounded by the HID service's handle
+ * range:
+ *
+ *   primary service -> characteristics -> descriptors (one pass for every
+ *   Report Reference and CCC) -> one Read Multiple Variable for HID
+ *   Information, the Report References and the start of the Report Map ->
+ *   rest of the Report Map -> subscribe to input reports
+ *
+ * If the keyboard does not support Read Multiple Variable, or the values do
+ * not fit one response, the Report References are read one at a time.
+ *
+ * With CONFIG_BRIDGE_GATT_CACHE the chain starts with a read of the peer's
+ * GATT Database Hash. If it matches the hash saved with the handles found
+ * last time, the saved handles, Report References and Report Map are used
+ * and the bridge subscribes straight away.
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/uuid.h>
+#include <zephyr/bluetooth/gatt.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "hids_client.h"
+#include "persist.h"
+
+LOG_MODULE_DECLARE(ble_bridge, LOG_LEVEL_INF);
+
+/* BLE UUIDs */
+#define BT_UUID_HIDS_VAL 0x1812
+/* BT_UUID_HIDS_REPORT_VAL and friends are already defined in uuid.h */
+
+static struct bt_uuid_16 uuid_hids = BT_UUID_INIT_16(BT_UUID_HIDS_VAL);
+static struct bt_uuid_16 uuid_report = BT_UUID_INIT_16(BT_UUID_HIDS_REPORT_VAL);
+static struct bt_uuid_16 uuid_report_map = BT_UUID_INIT_16(BT_UUID_HIDS_REPORT_MAP_VAL);
+static struct bt_uuid_16 uuid_report_ref = BT_UUID_INIT_16(BT_UUID_HIDS_REPORT_REF_VAL);
+static struct bt_uuid_16 uuid_hid_info = BT_UUID_INIT_16(BT_UUID_HIDS_INFO_VAL);
+static struct bt_uuid_16 uuid_ccc = BT_UUID_INIT_16(BT_UUID_GATT_CCC_VAL);
+#if IS_ENABLED(CONFIG_BRIDGE_GATT_CACHE)
+static struct bt_uuid_16 uuid_db_hash = BT_UUID_INIT_16(BT_UUID_GATT_DB_HASH_VAL);
+#endif
+
+#define HIDS_DB_HASH_SIZE 16
+#define HIDS_INFO_SIZE    4     /* bcdHID, bCountryCode, Flags */
+
+/* Batched read: HID Information, every Report Reference, Report Map */
+#define HIDS_BATCH_MAX    (HIDS_MAX_REPORTS + 2)
+#define HIDS_BATCH_INFO   0xFE
+#define HIDS_BATCH_MAP    0xFF
+
+enum hids_client_state {
+    HIDS_CLIENT_IDLE,
+    HIDS_CLIENT_RESUMED,        /* Subscribed from the cache, not yet verified */
+    HIDS_CLIENT_DISCOVERING,
+    HIDS_CLIENT_READY,
+};
+
+struct hids_client {
+    struct bt_conn *conn;
+    enum hids_client_state state;
+
+    /* HID service handles found during discovery */
+    uint16_t service_handle;
+    uint16_t service_end_handle;
+    uint16_t report_map_handle;
+    uint16_t info_handle;
+    struct hids_report reports[HIDS_MAX_REPORTS];
+    uint8_t report_count;
+    uint16_t desc_end[HIDS_MAX_REPORTS];  /* Last handle of each report's descriptors */
+    uint8_t ref_index;      /* Next Report Reference to read */
+    uint8_t ccc_index;      /* Next CCC to write after a lost subscription */
+
+    struct bt_gatt_discover_params discover_params;
+    struct bt_gatt_read_params read_params;
+    struct bt_gatt_write_params write_params;
+
+    /* Read Multiple Variable request and its position in the response */
+    uint16_t batch_handles[HIDS_BATCH_MAX];
+    uint8_t batch_items[HIDS_BATCH_MAX];    /* Report index or HIDS_BATCH_* */
+    uint8_t batch_count;
+    uint8_t batch_pos;
+    uint16_t batch_used;                    /* Response bytes consumed */
+    uint16_t batch_size;                    /* Response bytes available */
+
+    /* Report Map, read once per connection and compiled into report_map */
+    uint8_t report_map_buf[REPORT_MAP_MAX_SIZE];
+    uint16_t report_map_len;
+    struct report_map report_map;
+    bool report_map_valid;
+
+    /* Peer's GATT Database Hash, identifies the handles for the cache */
+    uint8_t db_hash[HIDS_DB_HASH_SIZE];
+    bool db_hash_valid;
+    bool from_cache;
+    bool resumed;           /* Subscriptions restored without a CCC write */
+};
+
+/* One client per link, at the connection's index */
+static struct hids_client clients[CONFIG_BT_MAX_CONN];
+static const struct hids_client_cb *client_cb;
+
+static struct hids_client *hids_client_get(struct bt_conn *conn)
+{
+    struct hids_client *c = &clients[bt_conn_index(conn)];
+
+    return (c->conn == conn) ? c : NULL;
+}
+
+/* Start over on a connection; its reports carry the link's index as source */
+static struct hids_client *hids_client_claim(struct bt_conn *conn)
+{
+    uint8_t index = bt_conn_index(conn);
+    struct hids_client *c = &clients[index];
+
+    memset(c, 0, sizeof(*c));
+    c->conn = conn;
+    for (uint8_t i = 0; i < HIDS_MAX_REPORTS; i++) {
+        c->reports[i].source = index;
+    }
+
+    return c;
+}
+
+/* Discovery or verification over; the client is usable if err is 0 */
+static void hids_client_done(struct hids_client *c, int err)
+{
+    c->state = err ? HIDS_CLIENT_IDLE : HIDS_CLIENT_READY;
+
+    if (client_cb->ready) {
+        client_cb->ready(c->conn, err);
+    }
+}
+
+/* Map a compiled report to the USB side by its application collection */
+static enum report_route hids_report_route(const struct report_info *info)
+{
+    /* Input reports, and the keyboard's LED output report */
+    if (info->type == REPORT_TYPE_FEATURE) {
+        return REPORT_ROUTE_NONE;
+    }
+
+    if (info->app_usage_page == USAGE_PAGE_GENERIC_DESKTOP &&
+        info->app_usage == USAGE_GD_KEYBOARD) {
+        return REPORT_ROUTE_KEYBOARD;
+    }
+
+    if (info->app_usage_page == USAGE_PAGE_CONSUMER &&
+        info->app_usage == USAGE_CONSUMER_CONTROL) {
+        return REPORT_ROUTE_CONSUMER;
+    }
+
+    if (info->app_usage_page == USAGE_PAGE_GENERIC_DESKTOP &&
+        info->app_usage == USAGE_GD_SYSTEM_CONTROL) {
+        return REPORT_ROUTE_SYSTEM;
+    }
+
+    if (info->app_usage_page == USAGE_PAGE_GENERIC_DESKTOP &&
+        info->app_usage == USAGE_GD_MOUSE) {
+        return REPORT_ROUTE_POINTER;
+    }
+
+    return REPORT_ROUTE_NONE;
+}
+
+/* BLE HID Report notification handler */
+static uint8_t notify_func(struct bt_conn *conn,
+                          struct bt_gatt_subscribe_params *params,
+                          const void *data, uint16_t length)
+{
+    /* Each report owns its subscription, so this is the routing lookup */
+    struct hids_report *report = CONTAINER_OF(params, struct hids_report, sub);
+
+    if (!data) {
+        LOG_WRN("Unsubscribed from report handle %u", report->value_handle);
+        params->value_handle = 0U;
+        return BT_GATT_ITER_STOP;
+    }
+
+    if (length == 0) {
+        LOG_WRN("Received empty HID report");
+        return BT_GATT_ITER_CONTINUE;
+    }
+
+    client_cb->report(report, data, length);
+
+    return BT_GATT_ITER_CONTINUE;
+}
+
+/* Subscribe through the CCC found during discovery; 0 or a negative errno */
+static int subscribe_to_report(struct bt_conn *conn, struct hids_report *report)
+{
+    struct bt_gatt_subscribe_params *params = &report->sub;
+
+    /* Clear any existing subscription params */
+    memset(params, 0, sizeof(*params));
+
+    if (!report->ccc_handle) {
+        LOG_ERR("Report ID %u (handle %u) has no CCC, not subscribing",
+                report->id, report->value_handle);
+        return -ENOENT;
+    }
+
+    /* The subscription ends with the link; reconnects restore it explicitly */
+    atomic_set_bit(params->flags, BT_GATT_SUBSCRIBE_FLAG_VOLATILE);
+
+    /* Set up subscription */
+    params->notify = notify_func;
+    params->value = BT_GATT_CCC_NOTIFY;
+    params->value_handle = report->value_handle;
+    params->ccc_handle = report->ccc_handle;
+
+    int err = bt_gatt_subscribe(conn, params);
+    if (err && err != -EALREADY) {
+        LOG_ERR("Subscribe to report ID %u failed (err %d)", report->id, err);
+        return err;
+    }
+
+    LOG_INF("Subscribed to report ID %u (handle %u)", report->id,
+            report->value_handle);
+    return 0;
+}
+
+#if IS_ENABLED(CONFIG_BRIDGE_GATT_CACHE)
+/*
+ * GATT handle cache, one settings entry per keyboard under
+ * ble_bridge/hids/<address>. The Report Map is kept compiled
+ * (report_map_pack()), so a keyboard whose Database Hash is unchanged is
+ * translated without reading or parsing its descriptor. The raw map is
+ * only kept for descriptor passthrough.
+ */
+/* 2: CCC handles come from descriptor discovery instead of a guess */
+/* 3: Compiled Report Map instead of the raw descriptor */
+#define HIDS_CACHE_VERSION 3
+
+struct hids_cache_report {
+    uint16_t value_handle;
+    uint16_t ref_handle;
+    uint16_t ccc_handle;
+    uint8_t properties;
+    uint8_t id;
+    uint8_t type;
+} __packed;
+
+struct hids_cache {
+    uint8_t version;
+    uint8_t db_hash[HIDS_DB_HASH_SIZE];
+    uint16_t service_handle;
+    uint16_t service_end_handle;
+    uint16_t report_map_handle;
+    uint8_t report_count;
+    struct hids_cache_report reports[HIDS_MAX_REPORTS];
+    uint16_t table_len;         /* Compiled Report Map, 0 if it did not compile */
+    uint16_t report_map_len;    /* Raw Report Map after it, passthrough only */
+    uint8_t data[REPORT_MAP_PACKED_MAX_SIZE + REPORT_MAP_MAX_SIZE];
+} __packed;
+
+#define HIDS_CACHE_HEADER_SIZE offsetof(struct hids_cache, data)
+
+/*
+ * Shared by all links: resumed on the system workqueue, stored from BT RX.
+ * Holds the entry of the keyboard last resumed, stored or preloaded, its
+ * table already unpacked into cache_map.
+ */
+static struct hids_cache cache;
+static struct report_map cache_map;
+static bt_addr_le_t cache_addr;
+static bool cache_warm;
+static K_MUTEX_DEFINE(cache_lock);
+
+static void hids_cache_key(const bt_addr_le_t *addr, char *key, size_t size)
+{
+    const uint8_t *a = addr->a.val;
+
+    snprintk(key, size, "ble_bridge/hids/%02x%02x%02x%02x%02x%02x%u",
+             a[5], a[4], a[3], a[2], a[1], a[0], addr->type);
+}
+
+/* Entry for a keyboard in cache; false if there is no usable one */
+static bool hids_cache_load(const bt_addr_le_t *addr)
+{
+    char key[SETTINGS_MAX_NAME_LEN];
+    ssize_t len;
+
+    if (cache_warm && bt_addr_le_eq(addr, &cache_addr)) {
+        return true;
+    }
+
+    cache_warm = false;
+    hids_cache_key(addr, key, sizeof(key));
+    len = persist_read(key, &cache, sizeof(cache));
+    if (len < (ssize_t)HIDS_CACHE_HEADER_SIZE ||
+        cache.version != HIDS_CACHE_VERSION ||
+        cache.report_count > HIDS_MAX_REPORTS ||
+        cache.table_len > REPORT_MAP_PACKED_MAX_SIZE ||
+        cache.report_map_len > REPORT_MAP_MAX_SIZE ||
+        len != HIDS_CACHE_HEADER_SIZE + cache.table_len + cache.report_map_len) {
+        return false;
+    }
+
+    /* Another table version: discover again rather than guess */
+    if (cache.table_len && report_map_unpack(&cache_map, cache.data, cache.table_len)) {
+        LOG_INF("Saved Report Map table outdated, discovering again");
+        return false;
+    }
+
+    bt_addr_le_copy(&cache_addr, addr);
+    cache_warm = true;
+    return true;
+}
+
+/* Save the handles found by a full discovery, keyed by the peer's DB Hash */
+static void hids_cache_store(struct hids_client *c)
+{
+    char key[SETTINGS_MAX_NAME_LEN];
+    int len = 0;
+    int err;
+
+    k_mutex_lock(&cache_lock, K_FOREVER);
+
+    memset(&cache, 0, HIDS_CACHE_HEADER_SIZE);
+    cache.version = HIDS_CACHE_VERSION;
+    memcpy(cache.db_hash, c->db_hash, sizeof(cache.db_hash));
+    cache.service_handle = c->service_handle;
+    cache.service_end_handle = c->service_end_handle;
+    cache.report_map_handle = c->report_map_handle;
+    cache.report_count = c->report_count;
+
+    for (uint8_t i = 0; i < c->report_count; i++) {
+        const struct hids_report *report = &c->reports[i];
+
+        cache.reports[i] = (struct hids_cache_report){
+            .value_handle = report->value_handle,
+            .ref_handle = report->ref_handle,
+            .ccc_handle = report->ccc_handle,
+            .properties = report->properties,
+            .id = report->id,
+            .type = report->type,
+        };
+    }
+
+    if (c->report_map_valid) {
+        len = report_map_pack(&c->report_map, cache.data, REPORT_MAP_PACKED_MAX_SIZE);
+        cache.table_len = (len > 0) ? len : 0;
+        cache_map = c->report_map;
+#if IS_ENABLED(CONFIG_BRIDGE_DESCRIPTOR_PASSTHROUGH)
+        cache.report_map_len = c->report_map_len;
+        memcpy(&cache.data[cache.table_len], c->report_map_buf, c->report_map_len);
+#endif
+    }
+
+    bt_addr_le_copy(&cache_addr, bt_conn_get_dst(c->conn));
+    cache_warm = true;
+
+    hids_cache_key(&cache_addr, key, sizeof(key));
+    err = persist_save(key, &cache, HIDS_CACHE_HEADER_SIZE + cache.table_len +
+                                    cache.report_map_len);
+    k_mutex_unlock(&cache_lock);
+    if (err) {
+        LOG_WRN("Failed to save GATT handles (err %d)", err);
+    } else {
+        LOG_INF("GATT handles and Report Map table saved (%u bytes)", cache.table_len);
+    }
+}
+
+/* Fill the client tables from the loaded cache entry */
+static void hids_cache_apply(struct hids_client *c)
+{
+    c->service_handle = cache.service_handle;
+    c->service_end_handle = cache.service_end_handle;
+    c->report_map_handle = cache.report_map_handle;
+    c->report_count = cache.report_count;
+
+    for (uint8_t i = 0; i < cache.report_count; i++) {
+        const struct hids_cache_report *saved = &cache.reports[i];
+        struct hids_report *report = &c->reports[i];
+
+        report->value_handle = saved->value_handle;
+        report->ref_handle = saved->ref_handle;
+        report->ccc_handle = saved->ccc_handle;
+        report->properties = saved->properties;
+        report->id = saved->id;
+        report->type = saved->type;
+    }
+
+    /* Compiled already: nothing to read or parse */
+    c->report_map_valid = cache.table_len != 0;
+    if (c->report_map_valid) {
+        c->report_map = cache_map;
+    }
+    c->report_map_len = cache.report_map_len;
+    memcpy(c->report_map_buf, &cache.data[cache.table_len], cache.report_map_len);
+    c->from_cache = true;
+}
+
+/* Take the handles from the cache if the peer's database is unchanged */
+static bool hids_cache_restore(struct hids_client *c)
+{
+    bool restored = false;
+
+    k_mutex_lock(&cache_lock, K_FOREVER);
+    if (hids_cache_load(bt_conn_get_dst(c->conn)) &&
+        !memcmp(cache.db_hash, c->db_hash, sizeof(cache.db_hash))) {
+        hids_cache_apply(c);
+        restored = true;
+    }
+    k_mutex_unlock(&cache_lock);
+
+    return restored;
+}
+
+void hids_client_preload(const bt_addr_le_t *addr)
+{
+    k_mutex_lock(&cache_lock, K_FOREVER);
+    if (hids_cache_load(addr)) {
+        LOG_DBG("GATT handles preloaded, %u reports", cache.report_count);
+    }
+    k_mutex_unlock(&cache_lock);
+}
+
+void hids_client_forget(const bt_addr_le_t *addr)
+{
+    char key[SETTINGS_MAX_NAME_LEN];
+
+    k_mutex_lock(&cache_lock, K_FOREVER);
+    if (bt_addr_le_eq(addr, &cache_addr)) {
+        cache_warm = false;
+    }
+    k_mutex_unlock(&cache_lock);
+
+    hids_cache_key(addr, key, sizeof(key));
+    persist_delete(key);
+}
+#else
+void hids_client_preload(const bt_addr_le_t *addr)
+{
+}
+
+void hids_client_forget(const bt_addr_le_t *addr)
+{
+}
+#endif
+
+/* Bind every report to its Report Map entry and route */
+static void hids_client_bind_reports(struct hids_client *c)
+{
+    bool fallback_bound = false;
+    bool fallback_leds_bound = false;
+
+    for (uint8_t i = 0; i < c->report_count; i++) {
+        struct hids_report *report = &c->reports[i];
+
+        report->map = NULL;
+        report->info = NULL;
+        report->route = REPORT_ROUTE_NONE;
+        report->passthrough = false;
+
+        if (c->report_map_valid) {
+            report->map = &c->report_map;
+            report->info = report_map_find(&c->report_map, report->type,
+                                           report->id);
+            if (report->info) {
+                report->route = hids_report_route(report->info);
+            }
+        } else if (report->type == REPORT_TYPE_INPUT && !fallback_bound) {
+            /* No Report Map - assume the first input report is a boot keyboard */
+            report->route = REPORT_ROUTE_KEYBOARD;
+            fallback_bound = true;
+        } else if (report->type == REPORT_TYPE_OUTPUT && !fallback_leds_bound) {
+            /* ... and the first output report its boot LED report */
+            report->route = REPORT_ROUTE_KEYBOARD;
+            fallback_leds_bound = true;
+        }
+
+        client_cb->bound(report);
+
+        LOG_INF("Report ID %u type %u handle %u -> route %d%s", report->id,
+                report->type, report->value_handle, report->route,
+                report->passthrough ? " (passthrough)" : "");
+    }
+}
+
+/* Discovery finished - subscribe to every input report */
+static void hids_client_subscribe_all(struct hids_client *c)
+{
+    uint8_t inputs = 0;
+    uint8_t subscribed = 0;
+
+    hids_client_bind_reports(c);
+
+    for (uint8_t i = 0; i < c->report_count; i++) {
+        struct hids_report *report = &c->reports[i];
+
+        if (report->type == REPORT_TYPE_INPUT &&
+            (report->properties & BT_GATT_CHRC_NOTIFY)) {
+            inputs++;
+            if (!subscribe_to_report(c->conn, report)) {
+                subscribed++;
+            }
+        }
+    }
+
+    if (!inputs) {
+        LOG_ERR("No HID input report characteristic found");
+    } else if (subscribed < inputs) {
+        LOG_WRN("Subscribed to %u of %u input reports", subscribed, inputs);
+    }
+
+#if IS_ENABLED(CONFIG_BRIDGE_GATT_CACHE)
+    /* Only a complete set is worth resuming from next time */
+    if (c->db_hash_valid && !c->from_cache && subscribed && subscribed == inputs) {
+        hids_cache_store(c);
+    }
+#endif
+
+    /* Clear discovery params as we're done with discovery */
+    memset(&c->discover_params, 0, sizeof(c->discover_params));
+    hids_client_done(c, subscribed ? 0 : -ENOENT);
+}
+
+/* Hand the raw Report Map on, for descriptor passthrough */
+static void report_map_publish(struct hids_client *c)
+{
+    if (c->report_map_valid && c->report_map_len && client_cb->report_map) {
+        client_cb->report_map(c->report_map_buf, c->report_map_len);
+    }
+}
+
+/* Compile the fetched Report Map */
+static void report_map_compile(struct hids_client *c)
+{
+    int err = report_map_parse(&c->report_map, c->report_map_buf,
+                               c->report_map_len);
+    if (err) {
+        LOG_WRN("Report Map parse failed (err %d), assuming boot reports", err);
+        c->report_map_valid = false;
+        return;
+    }
+
+    c->report_map_valid = true;
+    report_map_publish(c);
+}
+
+/* Report Map read - called per chunk of the long read, then with NULL data */
+static uint8_t report_map_read_func(struct bt_conn *conn, uint8_t err,
+                                    struct bt_gatt_read_params *params,
+                                    const void *data, uint16_t length)
+{
+    struct hids_client *c = CONTAINER_OF(params, struct hids_client, read_params);
+
+    /*
+     * A value of exactly ATT_MTU - 1 bytes ends with "not long", one that
+     * ended exactly with the batched read with "invalid offset"
+     */
+    if (err && !((err == BT_ATT_ERR_ATTRIBUTE_NOT_LONG ||
+                  err == BT_ATT_ERR_INVALID_OFFSET) && c->report_map_len)) {
+        LOG_WRN("Report Map read failed (err 0x%02x), assuming boot reports", err);
+        hids_client_subscribe_all(c);
+        return BT_GATT_ITER_STOP;
+    }
+
+    if (data) {
+        if (c->report_map_len + length > sizeof(c->report_map_buf)) {
+            LOG_WRN("Report Map exceeds %u bytes, assuming boot reports",
+                    (unsigned int)sizeof(c->report_map_buf));
+            hids_client_subscribe_all(c);
+            return BT_GATT_ITER_STOP;
+        }
+
+        memcpy(&c->report_map_buf[c->report_map_len], data, length);
+        c->report_map_len += length;
+        return BT_GATT_ITER_CONTINUE;
+    }
+
+    LOG_INF("Report Map read (%u bytes)", c->report_map_len);
+    report_map_compile(c);
+    hids_client_subscribe_all(c);
+
+    return BT_GATT_ITER_STOP;
+}
+
+/* Read the Report Map from offset on; the first offset bytes are already in */
+static void hids_client_read_report_map(struct hids_client *c, uint16_t offset)
+{
+    if (c->report_map_handle) {
+        memset(&c->read_params, 0, sizeof(c->read_params));
+        c->read_params.func = report_map_read_func;
+        c->read_params.handle_count = 1;
+        c->read_params.single.handle = c->report_map_handle;
+        c->read_params.single.offset = offset;
+        c->report_map_len = offset;
+
+        int err = bt_gatt_read(c->conn, &c->read_params);
+        if (!err) {
+            return;
+        }
+        LOG_WRN("Report Map read request failed (err %d)", err);
+    }
+
+    hids_client_subscribe_all(c);
+}
+
+static void hids_client_read_next_ref(struct hids_client *c);
+
+static uint8_t report_ref_read_func(struct bt_conn *conn, uint8_t err,
+                                    struct bt_gatt_read_params *params,
+                                    const void *data, uint16_t length)
+{
+    struct hids_client *c = CONTAINER_OF(params, struct hids_client, read_params);
+    struct hids_report *report = &c->reports[c->ref_index];
+
+    if (err) {
+        LOG_WRN("Report Reference read failed (err 0x%02x)", err);
+    } else if (data && length >= 2) {
+        const uint8_t *ref = data;
+
+        report->id = ref[0];
+        report->type = ref[1];
+    }
+
+    c->ref_index++;
+    hids_client_read_next_ref(c);
+
+    return BT_GATT_ITER_STOP;
+}
+
+/* Read the Report References one at a time, then the Report Map */
+static void hids_client_read_next_ref(struct hids_client *c)
+{
+    while (c->ref_index < c->report_count) {
+        struct hids_report *report = &c->reports[c->ref_index];
+
+        if (report->ref_handle) {
+            memset(&c->read_params, 0, sizeof(c->read_params));
+            c->read_params.func = report_ref_read_func;
+            c->read_params.handle_count = 1;
+            c->read_params.single.handle = report->ref_handle;
+            c->read_params.single.offset = 0;
+
+            int err = bt_gatt_read(c->conn, &c->read_params);
+            if (!err) {
+                return;
+            }
+            LOG_WRN("Report Reference read request failed (err %d)", err);
+        }
+
+        c->ref_index++;
+    }
+
+    hids_client_read_report_map(c, 0);
+}
+
+/* Store one value of the batched read */
+static void hids_client_batch_value(struct hids_client *c, uint8_t item,
+                                    const uint8_t *data, uint16_t length)
+{
+    if (item == HIDS_BATCH_INFO) {
+        if (length >= HIDS_INFO_SIZE) {
+            LOG_INF("HID Information: bcdHID 0x%04x, country %u, flags 0x%02x",
+                    sys_get_le16(data), data[2], data[3]);
+        }
+    } else if (item == HIDS_BATCH_MAP) {
+        c->report_map_len = MIN(length, sizeof(c->report_map_buf));
+        memcpy(c->report_map_buf, data, c->report_map_len);
+    } else if (length >= 2) {
+        c->reports[item].id = data[0];
+        c->reports[item].type = data[1];
+    }
+}
+
+static uint8_t batch_read_func(struct bt_conn *conn, uint8_t err,
+                               struct bt_gatt_read_params *params,
+                               const void *data, uint16_t length)
+{
+    struct hids_client *c = CONTAINER_OF(params, struct hids_client, read_params);
+    bool map_read = c->batch_items[c->batch_count - 1] == HIDS_BATCH_MAP;
+
+    if (err) {
+        LOG_INF("Read Multiple Variable failed (err 0x%02x), reading one at a time",
+                err);
+        c->report_map_len = 0;
+        c->ref_index = 0;
+        hids_client_read_next_ref(c);
+        return BT_GATT_ITER_STOP;
+    }
+
+    /* One call per value, in request order, then one with NULL data */
+    if (data) {
+        if (c->batch_pos < c->batch_count) {
+            hids_client_batch_value(c, c->batch_items[c->batch_pos], data, length);
+            c->batch_used += sizeof(uint16_t) + length;
+            c->batch_pos++;
+        }
+        return BT_GATT_ITER_CONTINUE;
+    }
+
+    if (!map_read) {
+        hids_client_read_report_map(c, 0);
+    } else if (c->batch_used >= c->batch_size) {
+        /* The Report Map filled the response and may go on */
+        hids_client_read_report_map(c, c->report_map_len);
+    } else {
+        LOG_INF("Report Map read (%u bytes)", c->report_map_len);
+        report_map_compile(c);
+        hids_client_subscribe_all(c);
+    }
+
+    return BT_GATT_ITER_STOP;
+}
+
+static void hids_client_batch_add(struct hids_client *c, uint16_t handle,
+                                  uint8_t item)
+{
+    c->batch_handles[c->batch_count] = handle;
+    c->batch_items[c->batch_count] = item;
+    c->batch_count++;
+}
+
+/*
+ * Read HID Information, every Report Reference and the start of the Report
+ * Map with one Read Multiple Variable request. The Report Map goes last, so
+ * whatever the response has room for is the start of the map and the rest
+ * follows with Read Blob. Falls back to one read per attribute.
+ */
+static void hids_client_read_attributes(struct hids_client *c)
+{
+    uint16_t size = bt_gatt_get_mtu(c->conn) - 1;
+    uint16_t used = 0;
+    int err;
+
+    c->batch_count = 0;
+    c->batch_pos = 0;
+    c->batch_used = 0;
+    c->batch_size = size;
+
+    if (c->info_handle) {
+        hids_client_batch_add(c, c->info_handle, HIDS_BATCH_INFO);
+        used += sizeof(uint16_t) + HIDS_INFO_SIZE;
+    }
+
+    for (uint8_t i = 0; i < c->report_count; i++) {
+        if (c->reports[i].ref_handle) {
+            hids_client_batch_add(c, c->reports[i].ref_handle, i);
+            used += sizeof(uint16_t) + 2;
+        }
+    }
+
+    /* The map needs room for its length and at least one byte */
+    if (c->report_map_handle && used + sizeof(uint16_t) < size) {
+        hids_client_batch_add(c, c->report_map_handle, HIDS_BATCH_MAP);
+    }
+
+    if (c->batch_count >= 2 && used <= size) {
+        memset(&c->read_params, 0, sizeof(c->read_params));
+        c->read_params.func = batch_read_func;
+        c->read_params.handle_count = c->batch_count;
+        c->read_params.multiple.handles = c->batch_handles;
+        c->read_params.multiple.variable = true;
+
+        err = bt_gatt_read(c->conn, &c->read_params);
+        if (!err) {
+            return;
+        }
+        LOG_DBG("Read Multiple Variable unavailable (err %d)", err);
+    }
+
+    c->ref_index = 0;
+    hids_client_read_next_ref(c);
+}
+
+/*
+ * A characteristic's descriptors lie between its value and the next
+ * characteristic declaration. Find Information leaves the declarations and
+ * values out, so the ranges come from the characteristic pass; this closes
+ * the range of every report still open below a declaration at handle.
+ */
+static void hids_client_close_ranges(struct hids_client *c, uint32_t handle)
+{
+    for (uint8_t i = 0; i < c->report_count; i++) {
+        if (!c->desc_end[i] && c->reports[i].value_handle < handle) {
+            c->desc_end[i] = handle - 1;
+        }
+    }
+}
+
+/* Give a descriptor to the report whose range holds it */
+static void hids_client_descriptor(struct hids_client *c,
+                                   const struct bt_gatt_attr *attr)
+{
+    struct hids_report *owner = NULL;
+
+    for (uint8_t i = 0; i < c->report_count; i++) {
+        if (attr->handle > c->reports[i].value_handle &&
+            attr->handle <= c->desc_end[i]) {
+            owner = &c->reports[i];
+            break;
+        }
+    }
+
+    if (!owner) {
+        return;
+    }
+
+    if (!bt_uuid_cmp(attr->uuid, &uuid_report_ref.uuid)) {
+        owner->ref_handle = attr->handle;
+    } else if (!bt_uuid_cmp(attr->uuid, &uuid_ccc.uuid)) {
+        owner->ccc_handle = attr->handle;
+    }
+}
+
+/* GATT Discovery callbacks */
+static uint8_t discover_func(struct bt_conn *conn,
+                            const struct bt_gatt_attr *attr,
+                            struct bt_gatt_discover_params *params)
+{
+    struct hids_client *c = CONTAINER_OF(params, struct hids_client,
+                                         discover_params);
+    int err;
+
+    if (!attr) {
+        switch (params->type) {
+        case BT_GATT_DISCOVER_PRIMARY:
+            if (!c->service_handle) {
+                LOG_WRN("HID Service not found");
+                break;
+            }
+
+            /* Finished discovering services, now discover characteristics */
+            LOG_INF("HID Service found, discovering characteristics...");
+            memset(params, 0, sizeof(*params));
+            params->uuid = NULL;
+            params->func = discover_func;
+            params->type = BT_GATT_DISCOVER_CHARACTERISTIC;
+            params->start_handle = c->service_handle + 1;
+            params->end_handle = c->service_end_handle;
+
+            err = bt_gatt_discover(conn, params);
+            if (err) {
+                LOG_ERR("Discover characteristics failed (err %d)", err);
+                hids_client_done(c, err);
+            }
+            return BT_GATT_ITER_STOP;
+
+        case BT_GATT_DISCOVER_CHARACTERISTIC:
+            if (!c->report_count) {
+                LOG_ERR("No HID Report characteristics found");
+                break;
+            }
+
+            /* The last characteristic's descriptors run to the service end */
+            hids_client_close_ranges(c, (uint32_t)c->service_end_handle + 1);
+
+            /* One pass for the Report Reference and CCC of every report */
+            memset(params, 0, sizeof(*params));
+            params->uuid = NULL;
+            params->func = discover_func;
+            params->type = BT_GATT_DISCOVER_DESCRIPTOR;
+            params->start_handle = c->reports[0].value_handle;
+            params->end_handle = c->service_end_handle;
+
+            err = bt_gatt_discover(conn, params);
+            if (err) {
+                LOG_ERR("Discover descriptors failed (err %d)", err);
+                hids_client_read_attributes(c);
+            }
+            return BT_GATT_ITER_STOP;
+
+        case BT_GATT_DISCOVER_DESCRIPTOR:
+            hids_client_read_attributes(c);
+            return BT_GATT_ITER_STOP;
+
+        default:
+            break;
+        }
+
+        LOG_WRN("Discovery complete");
+        (void)memset(params, 0, sizeof(*params));
+        hids_client_done(c, -ENOENT);
+        return BT_GATT_ITER_STOP;
+    }
+
+    LOG_DBG("Discovered attr handle %u", attr->handle);
+
+    if (params->type == BT_GATT_DISCOVER_PRIMARY) {
+        /* Found HID service */
+        if (bt_uuid_cmp(params->uuid, &uuid_hids.uuid) == 0) {
+            const struct bt_gatt_service_val *svc = attr->user_data;
+
+            LOG_INF("Found HID Service at handle %u", attr->handle);
+            c->service_handle = attr->handle;
+            c->service_end_handle = svc->end_handle;
+        }
+    } else if (params->type == BT_GATT_DISCOVER_CHARACTERISTIC) {
+        const struct bt_gatt_chrc *chrc = attr->user_data;
+        uint16_t value_handle = bt_gatt_attr_value_handle(attr);
+
+        hids_client_close_ranges(c, attr->handle);
+
+        if (!bt_uuid_cmp(chrc->uuid, &uuid_report_map.uuid)) {
+            LOG_INF("Found HID Report Map at handle %u", value_handle);
+            c->report_map_handle = value_handle;
+        } else if (!bt_uuid_cmp(chrc->uuid, &uuid_hid_info.uuid)) {
+            c->info_handle = value_handle;
+        } else if (!bt_uuid_cmp(chrc->uuid, &uuid_report.uuid)) {
+            if (c->report_count >= HIDS_MAX_REPORTS) {
+                LOG_WRN("Ignoring HID Report at handle %u, table full",
+                        value_handle);
+                return BT_GATT_ITER_CONTINUE;
+            }
+
+            struct hids_report *report = &c->reports[c->report_count++];
+
+            LOG_INF("Found HID Report characteristic at handle %u", attr->handle);
+            LOG_INF("Value handle: %u", value_handle);
+            report->value_handle = value_handle;
+            report->properties = chrc->properties;
+            /* Without a Report Reference, guess from the properties */
+            report->type = (chrc->properties & BT_GATT_CHRC_NOTIFY) ?
+                           REPORT_TYPE_INPUT : REPORT_TYPE_OUTPUT;
+        }
+    } else if (params->type == BT_GATT_DISCOVER_DESCRIPTOR) {
+        hids_client_descriptor(c, attr);
+    }
+
+    return BT_GATT_ITER_CONTINUE;
+}
+
+void hids_client_init(const struct hids_client_cb *cb)
+{
+    client_cb = cb;
+}
+
+/* Full discovery, starting with the HID primary service */
+static int hids_client_discover_service(struct hids_client *c)
+{
+    c->discover_params.uuid = &uuid_hids.uuid;
+    c->discover_params.func = discover_func;
+    c->discover_params.start_handle = BT_ATT_FIRST_ATTRIBUTE_HANDLE;
+    c->discover_params.end_handle = BT_ATT_LAST_ATTRIBUTE_HANDLE;
+    c->discover_params.type = BT_GATT_DISCOVER_PRIMARY;
+
+    int err = bt_gatt_discover(c->conn, &c->discover_params);
+    if (err) {
+        c->state = HIDS_CLIENT_IDLE;
+    }
+
+    return err;
+}
+
+#if IS_ENABLED(CONFIG_BRIDGE_GATT_CACHE)
+static void hids_client_verify(struct hids_client *c, const uint8_t *db_hash);
+
+/* Database Hash read - use the cached handles if it is unchanged */
+static uint8_t db_hash_read_func(struct bt_conn *conn, uint8_t err,
+                                 struct bt_gatt_read_params *params,
+                                 const void *data, uint16_t length)
+{
+    struct hids_client *c = CONTAINER_OF(params, struct hids_client, read_params);
+
+    if (c->resumed) {
+        hids_client_verify(c, (!err && data && length == HIDS_DB_HASH_SIZE) ?
+                              data : NULL);
+        return BT_GATT_ITER_STOP;
+    }
+
+    if (!err && data && length == HIDS_DB_HASH_SIZE) {
+        memcpy(c->db_hash, data, HIDS_DB_HASH_SIZE);
+        c->db_hash_valid = true;
+    } else {
+        LOG_DBG("No Database Hash (err 0x%02x), handles will not be cached", err);
+    }
+
+    if (c->db_hash_valid && hids_cache_restore(c)) {
+        LOG_INF("GATT database unchanged, using saved handles");
+        report_map_publish(c);
+        hids_client_subscribe_all(c);
+        return BT_GATT_ITER_STOP;
+    }
+
+    int disc_err = hids_client_discover_service(c);
+    if (disc_err) {
+        LOG_ERR("Discover failed (err %d)", disc_err);
+    }
+
+    return BT_GATT_ITER_STOP;
+}
+
+static int hids_client_read_db_hash(struct hids_client *c)
+{
+    memset(&c->read_params, 0, sizeof(c->read_params));
+    c->read_params.func = db_hash_read_func;
+    c->read_params.handle_count = 0;
+    c->read_params.by_uuid.uuid = &uuid_db_hash.uuid;
+    c->read_params.by_uuid.start_handle = BT_ATT_FIRST_ATTRIBUTE_HANDLE;
+    c->read_params.by_uuid.end_handle = BT_ATT_LAST_ATTRIBUTE_HANDLE;
+
+    return bt_gatt_read(c->conn, &c->read_params);
+}
+#endif
+
+#if IS_ENABLED(CONFIG_BRIDGE_GATT_CACHE)
+/*
+ * Resubscribe fast path
+ *
+ * A bonded keyboard keeps our CCC values across connections, so on
+ * reconnect the subscriptions only need to exist on our side. They are
+ * registered with bt_gatt_resubscribe() from the cached handles as soon as
+ * the link is up, before encryption, and nothing is written to the peer.
+ * Once encrypted the Database Hash is checked, and one CCC is read back in
+ * case the keyboard lost its bond state; only then are the CCCs written.
+ */
+static const uint8_t ccc_notify[] = { BT_GATT_CCC_NOTIFY, 0x00 };
+
+static void hids_client_write_next_ccc(struct hids_client *c);
+
+static void ccc_write_func(struct bt_conn *conn, uint8_t err,
+                           struct bt_gatt_write_params *params)
+{
+    struct hids_client *c = CONTAINER_OF(params, struct hids_client, write_params);
+
+    if (err) {
+        LOG_WRN("CCC write for report ID %u failed (err 0x%02x)",
+                c->reports[c->ccc_index].id, err);
+    }
+
+    c->ccc_index++;
+    hids_client_write_next_ccc(c);
+}
+
+/* Enable notifications on the peer, one input report at a time */
+static void hids_client_write_next_ccc(struct hids_client *c)
+{
+    while (c->ccc_index < c->report_count) {
+        struct hids_report *report = &c->reports[c->ccc_index];
+
+        if (report->type == REPORT_TYPE_INPUT && report->sub.ccc_handle) {
+            memset(&c->write_params, 0, sizeof(c->write_params));
+            c->write_params.func = ccc_write_func;
+            c->write_params.handle = report->sub.ccc_handle;
+            c->write_params.data = ccc_notify;
+            c->write_params.length = sizeof(ccc_notify);
+
+            int err = bt_gatt_write(c->conn, &c->write_params);
+            if (!err) {
+                return;
+            }
+            LOG_WRN("CCC write request failed (err %d)", err);
+        }
+
+        c->ccc_index++;
+    }
+
+    hids_client_done(c, 0);
+}
+
+static uint8_t ccc_read_func(struct bt_conn *conn, uint8_t err,
+                             struct bt_gatt_read_params *params,
+                             const void *data, uint16_t length)
+{
+    struct hids_client *c = CONTAINER_OF(params, struct hids_client, read_params);
+
+    if (!err && data && length >= 1 && !(((const uint8_t *)data)[0] & BT_GATT_CCC_NOTIFY)) {
+        LOG_INF("Keyboard lost its subscriptions, enabling notifications");
+        c->ccc_index = 0;
+        hids_client_write_next_ccc(c);
+        return BT_GATT_ITER_STOP;
+    }
+
+    if (err) {
+        LOG_WRN("CCC read failed (err 0x%02x), keeping subscriptions", err);
+    }
+
+    hids_client_done(c, 0);
+    return BT_GATT_ITER_STOP;
+}
+
+/* Link encrypted after a resume - confirm the cached view still holds */
+static void hids_client_verify(struct hids_client *c, const uint8_t *db_hash)
+{
+    if (db_hash && memcmp(db_hash, c->db_hash, HIDS_DB_HASH_SIZE)) {
+        /*
+         * The handles the subscriptions point at may now be anything;
+         * drop them with the link and rediscover from scratch.
+         */
+        LOG_WRN("GATT database changed, reconnecting to rediscover");
+        hids_client_forget(bt_conn_get_dst(c->conn));
+        bt_conn_disconnect(c->conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+        return;
+    }
+
+    if (!db_hash) {
+        LOG_WRN("Database Hash unavailable, keeping saved handles");
+    }
+
+    for (uint8_t i = 0; i < c->report_count; i++) {
+        struct hids_report *report = &c->reports[i];
+
+        if (report->type != REPORT_TYPE_INPUT || !report->sub.ccc_handle) {
+            continue;
+        }
+
+        memset(&c->read_params, 0, sizeof(c->read_params));
+        c->read_params.func = ccc_read_func;
+        c->read_params.handle_count = 1;
+        c->read_params.single.handle = report->sub.ccc_handle;
+        c->read_params.single.offset = 0;
+
+        if (!bt_gatt_read(c->conn, &c->read_params)) {
+            return;
+        }
+        break;
+    }
+
+    hids_client_done(c, 0);
+}
+
+static void resubscribe_to_report(struct hids_client *c, struct hids_report *report)
+{
+    struct bt_gatt_subscribe_params *params = &report->sub;
+    int err;
+
+    memset(params, 0, sizeof(*params));
+    if (!report->ccc_handle) {
+        return;
+    }
+
+    atomic_set_bit(params->flags, BT_GATT_SUBSCRIBE_FLAG_VOLATILE);
+    params->notify = notify_func;
+    params->value = BT_GATT_CCC_NOTIFY;
+    params->value_handle = report->value_handle;
+    params->ccc_handle = report->ccc_handle;
+
+    err = bt_gatt_resubscribe(BT_ID_DEFAULT, bt_conn_get_dst(c->conn), params);
+    if (err) {
+        LOG_WRN("Resubscribe to report ID %u failed (err %d)", report->id, err);
+    }
+}
+#endif
+
+int hids_client_resume(struct bt_conn *conn)
+{
+#if IS_ENABLED(CONFIG_BRIDGE_GATT_CACHE)
+    const bt_addr_le_t *peer = bt_conn_get_dst(conn);
+    struct hids_client *c;
+
+    if (!bt_le_bond_exists(BT_ID_DEFAULT, peer)) {
+        return -ENOENT;
+    }
+
+    k_mutex_lock(&cache_lock, K_FOREVER);
+    if (!hids_cache_load(peer)) {
+        k_mutex_unlock(&cache_lock);
+        return -ENOENT;
+    }
+
+    c = hids_client_claim(conn);
+    memcpy(c->db_hash, cache.db_hash, sizeof(c->db_hash));
+    c->db_hash_valid = true;
+    c->resumed = true;
+    hids_cache_apply(c);
+    k_mutex_unlock(&cache_lock);
+
+    report_map_publish(c);
+    hids_client_bind_reports(c);
+
+    for (uint8_t i = 0; i < c->report_count; i++) {
+        struct hids_report *report = &c->reports[i];
+
+        if (report->type == REPORT_TYPE_INPUT &&
+            (report->properties & BT_GATT_CHRC_NOTIFY)) {
+            resubscribe_to_report(c, report);
+        }
+    }
+
+    c->state = HIDS_CLIENT_RESUMED;
+    LOG_INF("Resumed %u reports from saved handles", c->report_count);
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
+
+int hids_client_discover(struct bt_conn *conn)
+{
+    struct hids_client *c = hids_client_get(conn);
+
+#if IS_ENABLED(CONFIG_BRIDGE_GATT_CACHE)
+    /* Resumed: only the Database Hash and one CCC need checking */
+    if (c && c->state == HIDS_CLIENT_RESUMED) {
+        c->state = HIDS_CLIENT_DISCOVERING;
+        if (hids_client_read_db_hash(c)) {
+            hids_client_verify(c, NULL);
+        }
+        return 0;
+    }
+#endif
+
+    c = hids_client_claim(conn);
+    c->state = HIDS_CLIENT_DISCOVERING;
+
+#if IS_ENABLED(CONFIG_BRIDGE_GATT_CACHE)
+    if (!hids_client_read_db_hash(c)) {
+        return 0;
+    }
+#endif
+
+    return hids_client_discover_service(c);
+}
+
+int hids_client_write(struct bt_conn *conn, const struct hids_report *report,
+                      const uint8_t *data, uint16_t len,
+                      bt_gatt_complete_func_t func, void *user_data)
+{
+    struct hids_client *c = hids_client_get(conn);
+
+    if (!c || c->state != HIDS_CLIENT_READY) {
+        /* Resumed: the handles are bound, the link is not yet verified */
+        return (c && c->resumed && c->state != HIDS_CLIENT_IDLE) ? -EAGAIN : -ENOTCONN;
+    }
+
+    if (report->type != REPORT_TYPE_OUTPUT ||
+        !(report->properties & BT_GATT_CHRC_WRITE_WITHOUT_RESP)) {
+        return -ENOTSUP;
+    }
+
+    return bt_gatt_write_without_response_cb(conn, report->value_handle, data,
+                                             len, false, func, user_data);
+}
+
+struct bt_conn *hids_client_conn_get(uint8_t source)
+{
+    struct bt_conn *conn = clients[source].conn;
+
+    return conn ? bt_conn_ref(conn) : NULL;
+}
+
+bool hids_client_active(struct bt_conn *conn)
+{
+    struct hids_client *c = hids_client_get(conn);
+
+    return c && c->state != HIDS_CLIENT_IDLE && c->state != HIDS_CLIENT_RESUMED;
+}
+
+void hids_client_reset(struct bt_conn *conn)
+{
+    struct hids_client *c = hids_client_get(conn);
+
+    if (c) {
+        memset(c, 0, sizeof(*c));
+    }
+}
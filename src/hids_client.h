@@ -0,0 +1,105 @@
+/*
+ * HID over GATT client
+ *
+ * Discovers the keyboard's HID service, reads the Report Reference of every
+ * Report characteristic and the Report Map, and subscribes to each input
+ * report. Every link has its own client, so several devices can be bound
+ * at once; each report records the link it belongs to. Notifications are
+ * handed to the bridge together with the report they arrived on, so
+ * routing costs one pointer lookup per report. Output reports are bound
+ * the same way and written without response.
+ */
+
+#ifndef HIDS_CLIENT_H_
+#define HIDS_CLIENT_H_
+
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/gatt.h>
+
+#include "report_map.h"
+
+#define HIDS_MAX_REPORTS 8
+
+/* Where the bridge forwards an input report */
+enum report_route {
+    REPORT_ROUTE_NONE,
+    REPORT_ROUTE_KEYBOARD,
+    REPORT_ROUTE_CONSUMER,
+    REPORT_ROUTE_SYSTEM,
+    REPORT_ROUTE_POINTER,
+};
+
+/* One HIDS Report characteristic */
+struct hids_report {
+    uint16_t value_handle;
+    uint16_t ref_handle;                /* Report Reference descriptor, 0 if absent */
+    uint16_t ccc_handle;                /* Client Characteristic Configuration, 0 if unknown */
+    uint8_t properties;                 /* GATT characteristic properties */
+    uint8_t id;                         /* From the Report Reference */
+    uint8_t type;                       /* REPORT_TYPE_* */
+    enum report_route route;
+    uint8_t source;                     /* Link it arrives on, bt_conn_index() */
+    bool passthrough;                   /* Same layout on both sides, forward verbatim */
+    const struct report_map *map;       /* Compiled Report Map, NULL if unavailable */
+    const struct report_info *info;     /* Entry in map for this report, NULL if unknown */
+    struct bt_gatt_subscribe_params sub;
+};
+
+struct hids_client_cb {
+    /* Report Map read and compiled, before reports are bound (optional) */
+    void (*report_map)(const uint8_t *desc, uint16_t len);
+    /* Report bound to its Report Map entry and route, before subscribing */
+    void (*bound)(struct hids_report *report);
+    /* Called from the BT RX thread for every input report notification */
+    void (*report)(const struct hids_report *report, const uint8_t *data,
+                   uint16_t length);
+    /* Discovery or verification finished, subscribed if err is 0 (optional) */
+    void (*ready)(struct bt_conn *conn, int err);
+};
+
+void hids_client_init(const struct hids_client_cb *cb);
+
+/*
+ * Bonded keyboard with saved handles: subscribe locally, without writing
+ * the CCCs, as soon as the link is up. Returns -ENOENT if there is nothing
+ * to resume; hids_client_discover() then runs in full once encrypted.
+ */
+int hids_client_resume(struct bt_conn *conn);
+
+/*
+ * Read a keyboard's saved handles and compiled Report Map ahead of its
+ * connection, so resuming it needs no flash access
+ */
+void hids_client_preload(const bt_addr_le_t *addr);
+
+/*
+ * Start discovery and subscription on a new connection, or verify a
+ * resumed one against the keyboard's Database Hash
+ */
+int hids_client_discover(struct bt_conn *conn);
+
+/*
+ * Write an output report without response. Never waits for a buffer when
+ * called from the system workqueue; func runs once the write has been sent.
+ * Returns -EAGAIN while a resumed connection is still being verified.
+ */
+int hids_client_write(struct bt_conn *conn, const struct hids_report *report,
+                      const uint8_t *data, uint16_t len,
+                      bt_gatt_complete_func_t func, void *user_data);
+
+/*
+ * Connection a report source belongs to, with a reference held; NULL if
+ * the link is gone. Call from the system workqueue, which also resets it.
+ */
+struct bt_conn *hids_client_conn_get(uint8_t source);
+
+/* True once discovery or verification has been started on this connection */
+bool hids_client_active(struct bt_conn *conn);
+
+/* Forget all handles and subscriptions after a disconnect */
+void hids_client_reset(struct bt_conn *conn);
+
+/* Drop the saved GATT handles of a keyboard that is no longer bonded */
+void hids_client_forget(const bt_addr_le_t *addr);
+
+#endif /* HIDS_CLIENT_H_ */
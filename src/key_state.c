@@ -0,0 +1,183 @@
+/*
+ * Keyboard key-state engine
+ */
+
+#include <string.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "key_state.h"
+
+/* Modifiers are bits 0-7 of the last word */
+#define KEY_MOD_WORD        (KEY_USAGE_LEFT_CONTROL / 32)
+
+struct key_decoder {
+    struct key_state *ks;
+    bool rollover;
+};
+
+static void key_decoder_add(uint16_t usage, void *user_data)
+{
+    struct key_decoder *d = user_data;
+
+    if (usage > UINT8_MAX) {
+        return;
+    }
+
+    if (usage >= KEY_USAGE_ERROR_ROLLOVER && usage <= KEY_USAGE_ERROR_UNDEFINED) {
+        d->rollover = true;
+        return;
+    }
+
+    if (usage != 0) {
+        key_state_set(d->ks, (uint8_t)usage);
+    }
+}
+
+bool key_state_from_report(struct key_state *ks, const struct report_map *map,
+                           const struct report_info *rep,
+                           const uint8_t *data, uint16_t len)
+{
+    struct key_decoder d = { .ks = ks };
+
+    memset(ks, 0, sizeof(*ks));
+    report_map_for_each_usage(map, rep, data, len, USAGE_PAGE_KEYBOARD,
+                              key_decoder_add, &d);
+
+    return !d.rollover;
+}
+
+bool key_state_from_boot(struct key_state *ks, const uint8_t *data, uint16_t len)
+{
+    struct key_decoder d = { .ks = ks };
+
+    memset(ks, 0, sizeof(*ks));
+
+    if (len > 0) {
+        ks->bits[KEY_MOD_WORD] = data[0];
+    }
+
+    for (uint16_t i = 2; i < MIN(len, BOOT_REPORT_SIZE); i++) {
+        key_decoder_add(data[i], &d);
+    }
+
+    return !d.rollover;
+}
+
+static void key_tracker_release(struct key_tracker *kt, uint8_t usage)
+{
+    for (uint8_t i = 0; i < kt->boot_count; i++) {
+        if (kt->boot_keys[i] == usage) {
+            memmove(&kt->boot_keys[i], &kt->boot_keys[i + 1],
+                    kt->boot_count - i - 1);
+            kt->boot_count--;
+            return;
+        }
+    }
+}
+
+static bool key_tracker_shown(const struct key_tracker *kt, uint8_t usage)
+{
+    for (uint8_t i = 0; i < kt->boot_count; i++) {
+        if (kt->boot_keys[i] == usage) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Give freed boot slots to held keys that did not fit before */
+static void key_tracker_refill(struct key_tracker *kt, const struct key_state *held)
+{
+    kt->waiting = false;
+
+    for (uint8_t w = 0; w < KEY_MOD_WORD; w++) {
+        uint32_t bits = held->bits[w];
+
+        while (bits) {
+            uint8_t usage = (uint8_t)(w * 32 + __builtin_ctz(bits));
+
+            bits &= bits - 1;
+            if (key_tracker_shown(kt, usage)) {
+                continue;
+            }
+            if (kt->boot_count == BOOT_REPORT_KEYS) {
+                kt->waiting = true;
+                return;
+            }
+            kt->boot_keys[kt->boot_count++] = usage;
+        }
+    }
+}
+
+bool key_tracker_update(struct key_tracker *kt, const struct key_state *next)
+{
+    struct key_state held;
+    uint32_t pressed[KEY_STATE_WORDS];
+    bool changed = false;
+
+    /* Releases first, so a key pressed in the same report can take the slot */
+    for (uint8_t w = 0; w < KEY_STATE_WORDS; w++) {
+        uint32_t diff = kt->state.bits[w] ^ next->bits[w];
+        uint32_t released = diff & kt->state.bits[w];
+
+        pressed[w] = diff & next->bits[w];
+        held.bits[w] = kt->state.bits[w] & next->bits[w];
+        changed |= (diff != 0);
+
+        /* Modifiers have their own byte in the boot report */
+        if (w == KEY_MOD_WORD) {
+            continue;
+        }
+
+        while (released) {
+            key_tracker_release(kt, (uint8_t)(w * 32 + __builtin_ctz(released)));
+            released &= released - 1;
+        }
+    }
+
+    if (!changed) {
+        return false;
+    }
+
+    /* Keys that were already waiting for a slot go before new presses */
+    if (kt->waiting && kt->boot_count < BOOT_REPORT_KEYS) {
+        key_tracker_refill(kt, &held);
+    }
+
+    for (uint8_t w = 0; w < KEY_MOD_WORD; w++) {
+        while (pressed[w]) {
+            uint8_t usage = (uint8_t)(w * 32 + __builtin_ctz(pressed[w]));
+
+            pressed[w] &= pressed[w] - 1;
+            if (kt->boot_count < BOOT_REPORT_KEYS) {
+                kt->boot_keys[kt->boot_count++] = usage;
+            } else {
+                kt->waiting = true;
+            }
+        }
+    }
+
+    kt->state = *next;
+    return true;
+}
+
+void key_tracker_to_boot(const struct key_tracker *kt,
+                         uint8_t boot[BOOT_REPORT_SIZE])
+{
+    memset(boot, 0, BOOT_REPORT_SIZE);
+    boot[0] = (uint8_t)kt->state.bits[KEY_MOD_WORD];
+    memcpy(&boot[2], kt->boot_keys, kt->boot_count);
+}
+
+void key_state_to_nkro(const struct key_state *ks,
+                       uint8_t nkro[NKRO_REPORT_SIZE])
+{
+    nkro[0] = (uint8_t)ks->bits[KEY_MOD_WORD];
+    nkro[1] = 0;
+
+    for (uint8_t w = 0; w < KEY_MOD_WORD; w++) {
+        sys_put_le32(ks->bits[w], &nkro[2 + w * 4]);
+    }
+}
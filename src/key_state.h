@@ -0,0 +1,85 @@
+/*
+ * Keyboard key-state engine
+ *
+ * The canonical keyboard state is a 256-bit bitmap with one bit per usage
+ * of the Keyboard/Keypad page, modifiers included (0xE0-0xE7). Incoming
+ * reports are decoded into a bitmap, compared against the current state a
+ * 32-bit word at a time, and the USB reports are rendered from it: an NKRO
+ * bitmap for report protocol and a six-key boot report for boot protocol.
+ */
+
+#ifndef KEY_STATE_H_
+#define KEY_STATE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "report_map.h"
+
+/* Boot keyboard report layout */
+#define BOOT_REPORT_SIZE            8
+#define BOOT_REPORT_KEYS            6
+
+#define KEY_USAGE_ERROR_ROLLOVER    0x01
+#define KEY_USAGE_ERROR_UNDEFINED   0x03
+#define KEY_USAGE_LEFT_CONTROL      0xE0
+#define KEY_USAGE_RIGHT_GUI         0xE7
+
+#define KEY_STATE_WORDS             8
+
+/*
+ * NKRO report payload: modifier byte, reserved byte, then one bit for
+ * each usage below the modifiers (0x00-0xDF).
+ */
+#define NKRO_BITMAP_USAGES          KEY_USAGE_LEFT_CONTROL
+#define NKRO_REPORT_SIZE            (2 + NKRO_BITMAP_USAGES / 8)
+
+struct key_state {
+    uint32_t bits[KEY_STATE_WORDS];
+};
+
+/*
+ * Current keys plus the non-modifier keys shown in the boot report. Boot
+ * slots are given out in press order, simultaneous presses by ascending
+ * usage. A freed slot goes first to keys left waiting, lowest usage first,
+ * so the 6KRO view is deterministic and a held key never drops out of it.
+ */
+struct key_tracker {
+    struct key_state state;
+    uint8_t boot_keys[BOOT_REPORT_KEYS];
+    uint8_t boot_count;
+    bool waiting;           /* Held keys that did not fit in boot_keys */
+};
+
+static inline void key_state_set(struct key_state *ks, uint8_t usage)
+{
+    ks->bits[usage >> 5] |= 1U << (usage & 0x1F);
+}
+
+static inline bool key_state_test(const struct key_state *ks, uint8_t usage)
+{
+    return (ks->bits[usage >> 5] >> (usage & 0x1F)) & 1U;
+}
+
+/*
+ * Decode a keyboard input report through its Report Map entry.
+ * Returns false if the report signals ErrorRollOver, in which case the
+ * previous state should be kept as the HID spec requires.
+ */
+bool key_state_from_report(struct key_state *ks, const struct report_map *map,
+                           const struct report_info *rep,
+                           const uint8_t *data, uint16_t len);
+
+/* Decode a boot-layout report; same return value as key_state_from_report */
+bool key_state_from_boot(struct key_state *ks, const uint8_t *data, uint16_t len);
+
+/* Apply a new state. Returns false if nothing changed. */
+bool key_tracker_update(struct key_tracker *kt, const struct key_state *next);
+
+void key_tracker_to_boot(const struct key_tracker *kt,
+                         uint8_t boot[BOOT_REPORT_SIZE]);
+
+void key_state_to_nkro(const struct key_state *ks,
+                       uint8_t nkro[NKRO_REPORT_SIZE]);
+
+#endif /* KEY_STATE_H_ */
@@ -10,7 +10,6 @@
 #include <zephyr/device.h>
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/usb/usb_device.h>
-#include <zephyr/usb/class/usb_hid.h>
 #include <zephyr/bluetooth/bluetooth.h>
 #include <zephyr/bluetooth/hci.h>
 #include <zephyr/bluetooth/conn.h>
@@ -18,66 +17,25 @@
 #include <zephyr/bluetooth/gatt.h>
 #include <zephyr/logging/log.h>
 #include <zephyr/settings/settings.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/reboot.h>
 
-LOG_MODULE_REGISTER(ble_bridge, LOG_LEVEL_INF);
+#include "report_map.h"
+#include "key_state.h"
+#include "hids_client.h"
+#include "usb_bridge.h"
+#include "ble_link.h"
+#include "conn_mgr.h"
+#include "persist.h"
 
-/* USB HID Report Descriptor for Boot Protocol Keyboard */
-static const uint8_t hid_report_desc[] = {
-    0x05, 0x01,     /* Usage Page (Generic Desktop) */
-    0x09, 0x06,     /* Usage (Keyboard) */
-    0xA1, 0x01,     /* Collection (Application) */
-    
-    /* Modifier keys byte */
-    0x05, 0x07,     /* Usage Page (Key Codes) */
-    0x19, 0xE0,     /* Usage Minimum (224) */
-    0x29, 0xE7,     /* Usage Maximum (231) */
-    0x15, 0x00,     /* Logical Minimum (0) */
-    0x25, 0x01,     /* Logical Maximum (1) */
-    0x75, 0x01,     /* Report Size (1) */
-    0x95, 0x08,     /* Report Count (8) */
-    0x81, 0x02,     /* Input (Data, Variable, Absolute) */
-    
-    /* Reserved byte */
-    0x75, 0x08,     /* Report Size (8) */
-    0x95, 0x01,     /* Report Count (1) */
-    0x81, 0x01,     /* Input (Constant) */
-    
-    /* Key array (6 keys) */
-    0x05, 0x07,     /* Usage Page (Key Codes) */
-    0x19, 0x00,     /* Usage Minimum (0) */
-    0x29, 0xFF,     /* Usage Maximum (255) */
-    0x15, 0x00,     /* Logical Minimum (0) */
-    0x26, 0xFF, 0x00, /* Logical Maximum (255) */
-    0x75, 0x08,     /* Report Size (8) */
-    0x95, 0x06,     /* Report Count (6) */
-    0x81, 0x00,     /* Input (Data, Array) */
-    
-    0xC0            /* End Collection */
-};
+LOG_MODULE_REGISTER(ble_bridge, LOG_LEVEL_INF);
 
-/* BLE UUIDs */
-#define BT_UUID_HIDS_VAL 0x1812
-#define BT_UUID_HIDS BT_UUID_DECLARE_16(BT_UUID_HIDS_VAL)
-/* BT_UUID_HIDS_REPORT_VAL is already defined in uuid.h */
-#define BT_UUID_HIDS_REPORT BT_UUID_DECLARE_16(BT_UUID_HIDS_REPORT_VAL)
-
-/* Device handles */
-static struct bt_conn *current_conn = NULL;
-static K_MUTEX_DEFINE(conn_mutex);  /* Mutex to protect current_conn access */
-static struct bt_gatt_subscribe_params subscribe_params;
-static struct bt_gatt_discover_params discover_params;
-static struct bt_uuid_16 uuid_hids = BT_UUID_INIT_16(BT_UUID_HIDS_VAL);
-static struct bt_uuid_16 uuid_report = BT_UUID_INIT_16(BT_UUID_HIDS_REPORT_VAL);
-
-/* Saved keyboard address for reconnection */
-static bt_addr_le_t keyboard_addr;
-static bool keyboard_paired = false;
-
-/* HID Report Buffer */
-#define HID_BOOT_REPORT_SIZE 8
-static uint8_t hid_report[HID_BOOT_REPORT_SIZE] = {0};
-static bool usb_configured = false;
-static const struct device *hid_dev;
+/* Report Map cached in flash for descriptor passthrough */
+#if IS_ENABLED(CONFIG_BRIDGE_DESCRIPTOR_PASSTHROUGH)
+static uint8_t report_map_cache[REPORT_MAP_MAX_SIZE];
+static uint16_t report_map_cache_len;
+static struct k_work report_map_save_work;
+#endif
 
 /* LED Indicators */
 #define LED0_NODE DT_ALIAS(led0)
@@ -90,30 +48,63 @@ static const struct gpio_dt_spec led = GPIO_DT_SPEC_GET(LED0_NODE, gpios);
 #if DT_NODE_HAS_STATUS(SW0_NODE, okay)
 static const struct gpio_dt_spec button = GPIO_DT_SPEC_GET(SW0_NODE, gpios);
 static struct gpio_callback button_cb_data;
-static struct k_work button_work;
-static uint64_t button_press_time = 0;
-static bool button_double_press = false;
+static struct k_work_delayable button_work;
+static atomic_t button_presses;
+
+/* Presses closer together than this count as one gesture */
+#define BUTTON_GESTURE_MS 500
 #endif
 
-/* Target device name - change this to match your Kinesis */
-#define TARGET_DEVICE_NAME "Adv360 Pro"
-#define TARGET_DEVICE_NAME_ALT "Adv360 Pro R"
-#define TARGET_DEVICE_NAME_ALT2 "Adv360 Pro L"
+/*
+ * Boot timeline: uptime in ms at which each stage was first reached, logged
+ * once the first keystroke has been forwarded to the host. Uptime starts
+ * at reset, so time spent in the bootloader is not included.
+ */
+struct boot_timeline {
+    uint32_t bt_ready;
+    uint32_t usb_configured;
+    uint32_t bound;             /* First keyboard's reports bound */
+    uint32_t first_key;
+};
+
+static struct boot_timeline boot;
+
+static void boot_mark(uint32_t *stage)
+{
+    if (!*stage) {
+        *stage = MAX(k_uptime_get_32(), 1U);
+    }
+}
+
+/* Keys just forwarded to the host; the first time any is down, log the timeline */
+static void boot_keys_forwarded(const struct key_state *keys)
+{
+    if (boot.first_key) {
+        return;
+    }
+
+    for (uint8_t w = 0; w < KEY_STATE_WORDS; w++) {
+        if (keys->bits[w]) {
+            boot_mark(&boot.first_key);
+            LOG_INF("Power-on to first keystroke: %u ms (Bluetooth ready %u ms, "
+                    "USB configured %u ms, keyboard bound %u ms)", boot.first_key,
+                    boot.bt_ready, boot.usb_configured, boot.bound);
+            return;
+        }
+    }
+}
 
 /* USB HID Callbacks */
 static void usb_hid_status_cb(enum usb_dc_status_code status, const uint8_t *param)
 {
     switch (status) {
     case USB_DC_CONFIGURED:
-        LOG_INF("USB configured");
-        usb_configured = true;
+        boot_mark(&boot.usb_configured);
 #if DT_NODE_HAS_STATUS(LED0_NODE, okay)
         gpio_pin_set_dt(&led, 1);
 #endif
         break;
     case USB_DC_DISCONNECTED:
-        LOG_INF("USB disconnected");
-        usb_configured = false;
 #if DT_NODE_HAS_STATUS(LED0_NODE, okay)
         gpio_pin_set_dt(&led, 0);
 #endif
@@ -123,167 +114,527 @@ static void usb_hid_status_cb(enum usb_dc_status_code status, const uint8_t *par
     }
 }
 
-static const struct hid_ops hid_ops = {
-    .get_report = NULL,
-    .set_report = NULL,
-    .int_in_ready = NULL,
-    .int_out_ready = NULL,
+/*
+ * Host LED output
+ *
+ * The host's LED state is forwarded to the LED output report of every
+ * linked keyboard from the system workqueue, so the USB and BT RX paths
+ * never wait on it. Only one write per keyboard is in flight; states
+ * arriving meanwhile overwrite host_leds and the completion picks up the
+ * latest, so rapid toggles collapse into one write.
+ */
+#define LED_WRITE_RETRY_MS 20
+#define LED_REPORT_MAX_SIZE 8
+
+/* One per link, at its source index */
+struct led_sink {
+    const struct hids_report *report;   /* LED output report, NULL if none */
+    int16_t sent;                       /* -1: keyboard state unknown */
 };
 
-/* BLE HID Report notification handler */
-static uint8_t notify_func(struct bt_conn *conn,
-                          struct bt_gatt_subscribe_params *params,
-                          const void *data, uint16_t length)
+static atomic_t host_leds = ATOMIC_INIT(0);
+static ATOMIC_DEFINE(led_write_busy, CONFIG_BT_MAX_CONN);
+static K_MUTEX_DEFINE(led_mutex);
+static struct led_sink led_sinks[CONFIG_BT_MAX_CONN];  /* Guarded by led_mutex */
+static struct k_work_delayable led_work;
+
+/* Build the keyboard's LED output report from the host's LED bits */
+static uint16_t hid_led_report(const struct hids_report *report, uint8_t leds,
+                               uint8_t *payload)
 {
-    if (!data) {
-        LOG_WRN("Unsubscribed");
-        params->value_handle = 0U;
-        return BT_GATT_ITER_STOP;
+    uint16_t len;
+
+    if (!report->info) {
+        /* Boot LED report */
+        payload[0] = leds;
+        return 1;
     }
 
-    /* Validate report length and copy safely */
-    if (length > 0) {
-        size_t copy_len = MIN(length, sizeof(hid_report));
-        
-        /* Clear report buffer first to ensure no stale data */
-        memset(hid_report, 0, sizeof(hid_report));
-        
-        /* Copy the received data */
-        memcpy(hid_report, data, copy_len);
-        
-        /* Log if we received unexpected report size */
-        if (length != HID_BOOT_REPORT_SIZE) {
-            LOG_WRN("Received HID report of %u bytes (expected %u)", 
-                    length, HID_BOOT_REPORT_SIZE);
-            
-            /* If report is longer, we might be getting NKRO or Report ID */
-            if (length > HID_BOOT_REPORT_SIZE) {
-                LOG_WRN("Report may include Report ID or be NKRO format");
-            }
+    len = report_info_size(report->info);
+    memset(payload, 0, len);
+
+    for (uint8_t usage = USAGE_LED_NUM_LOCK; usage <= USAGE_LED_KANA; usage++) {
+        if (leds & BIT(usage - USAGE_LED_NUM_LOCK)) {
+            report_map_set_usage(report->map, report->info, payload, len,
+                                 USAGE_PAGE_LED, usage);
         }
-        
-        /* Forward to USB if configured */
-        if (usb_configured && hid_dev) {
-            int ret = hid_int_ep_write(hid_dev, hid_report, sizeof(hid_report), NULL);
-            if (ret < 0 && ret != -EAGAIN) {
-                LOG_ERR("Failed to send HID report: %d", ret);
+    }
+
+    return len;
+}
+
+static void led_write_done(struct bt_conn *conn, void *user_data)
+{
+    atomic_clear_bit(led_write_busy, (uintptr_t)user_data);
+    k_work_reschedule(&led_work, K_NO_WAIT);
+}
+
+/* Send the host's LEDs to one keyboard; true if it should be tried again */
+static bool led_sink_update(uint8_t source, uint8_t leds)
+{
+    struct led_sink *sink = &led_sinks[source];
+    uint8_t payload[LED_REPORT_MAX_SIZE];
+    struct bt_conn *conn;
+    uint16_t len;
+    int err;
+
+    if (!sink->report || sink->sent == leds ||
+        atomic_test_and_set_bit(led_write_busy, source)) {
+        return false;
+    }
+
+    conn = hids_client_conn_get(source);
+    if (!conn) {
+        atomic_clear_bit(led_write_busy, source);
+        return false;
+    }
+
+    len = hid_led_report(sink->report, leds, payload);
+    err = hids_client_write(conn, sink->report, payload, len, led_write_done,
+                            (void *)(uintptr_t)source);
+    bt_conn_unref(conn);
+
+    if (err) {
+        atomic_clear_bit(led_write_busy, source);
+        if (err == -ENOMEM || err == -ENOBUFS || err == -EAGAIN) {
+            return true;
+        }
+        LOG_WRN("LED output write failed (err %d)", err);
+        return false;
+    }
+
+    sink->sent = leds;
+    return false;
+}
+
+static void led_work_handler(struct k_work *work)
+{
+    uint8_t leds = (uint8_t)atomic_get(&host_leds);
+    bool retry = false;
+
+    k_mutex_lock(&led_mutex, K_FOREVER);
+    for (uint8_t i = 0; i < ARRAY_SIZE(led_sinks); i++) {
+        retry |= led_sink_update(i, leds);
+    }
+    k_mutex_unlock(&led_mutex);
+
+    if (retry) {
+        /* No TX buffer, or link not verified yet; try again shortly */
+        k_work_reschedule(&led_work, K_MSEC(LED_WRITE_RETRY_MS));
+    }
+}
+
+/* Host LED output report - ISR context, just record it and defer */
+static void usb_host_leds(uint8_t leds)
+{
+    atomic_set(&host_leds, leds);
+    k_work_reschedule(&led_work, K_NO_WAIT);
+}
+
+static const struct usb_bridge_cb usb_cb = {
+    .status = usb_hid_status_cb,
+    .leds = usb_host_leds,
+};
+
+/* Keyboard LED output report bound - bring it in sync with the host */
+static void hid_led_report_bound(struct hids_report *report)
+{
+    if (report->info && report_info_size(report->info) > LED_REPORT_MAX_SIZE) {
+        LOG_WRN("LED report of %u bytes not supported",
+                report_info_size(report->info));
+        return;
+    }
+
+    k_mutex_lock(&led_mutex, K_FOREVER);
+    led_sinks[report->source] = (struct led_sink){ .report = report, .sent = -1 };
+    atomic_clear_bit(led_write_busy, report->source);
+    k_mutex_unlock(&led_mutex);
+
+    k_work_reschedule(&led_work, K_NO_WAIT);
+}
+
+/*
+ * Report Map bound - forward verbatim where both sides share a layout. The
+ * keyboard always goes through the key-state engine, which renders both the
+ * report protocol and the boot protocol view.
+ */
+static void hid_report_bound(struct hids_report *report)
+{
+    if (report->route == REPORT_ROUTE_KEYBOARD) {
+        boot_mark(&boot.bound);
+    }
+
+    if (report->type == REPORT_TYPE_OUTPUT) {
+        if (report->route == REPORT_ROUTE_KEYBOARD) {
+            hid_led_report_bound(report);
+        }
+        return;
+    }
+
+    switch (report->route) {
+    case REPORT_ROUTE_CONSUMER:
+        report->passthrough = usb_bridge_layout_matches(USB_REPORT_CONSUMER,
+                                                        report->map, report->info);
+        break;
+    case REPORT_ROUTE_SYSTEM:
+        report->passthrough = usb_bridge_layout_matches(USB_REPORT_SYSTEM,
+                                                        report->map, report->info);
+        break;
+    case REPORT_ROUTE_POINTER:
+        report->passthrough = usb_bridge_layout_matches(USB_REPORT_POINTER,
+                                                        report->map, report->info);
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Merge stage
+ *
+ * Every link is a source with its own share of each USB report. The host
+ * sees the union: keys, modifiers and buttons held on any source, and the
+ * consumer and system usages of all of them. Pointer motion goes out as it
+ * arrives; the USB report register sums what has not been sent yet. When a
+ * source goes away only its own share is released.
+ */
+struct merge_source {
+    struct key_state keys;
+    uint16_t consumer[USB_CONSUMER_REPORT_KEYS];
+    uint8_t consumer_count;
+    uint8_t system;         /* USB system control bits */
+    uint8_t buttons;        /* USB pointer button bits */
+};
+
+/* Reports arrive on the BT RX thread, releases on the system workqueue */
+static K_MUTEX_DEFINE(merge_mutex);
+static struct merge_source merge_sources[CONFIG_BT_MAX_CONN];  /* Guarded by merge_mutex */
+static struct key_tracker keyboard_keys;                        /* Guarded by merge_mutex */
+
+/* Pass the current key state to the host in both protocols' layouts */
+static void hid_keyboard_publish(void)
+{
+    uint8_t boot[BOOT_REPORT_SIZE];
+
+    key_tracker_to_boot(&keyboard_keys, boot);
+    usb_bridge_report(USB_REPORT_BOOT_KEYBOARD, boot, sizeof(boot));
+
+#if IS_ENABLED(CONFIG_BRIDGE_USB_NKRO)
+    uint8_t nkro[NKRO_REPORT_SIZE];
+
+    key_state_to_nkro(&keyboard_keys.state, nkro);
+    usb_bridge_report(USB_REPORT_KEYBOARD, nkro, sizeof(nkro));
+#else
+    usb_bridge_report(USB_REPORT_KEYBOARD, boot, sizeof(boot));
+#endif
+}
+
+/* Keys held on any source. Caller holds merge_mutex. */
+static void merge_keyboard_publish(void)
+{
+    struct key_state keys = {0};
+
+    for (uint8_t s = 0; s < ARRAY_SIZE(merge_sources); s++) {
+        for (uint8_t w = 0; w < KEY_STATE_WORDS; w++) {
+            keys.bits[w] |= merge_sources[s].keys.bits[w];
+        }
+    }
+
+    if (key_tracker_update(&keyboard_keys, &keys)) {
+        hid_keyboard_publish();
+        boot_keys_forwarded(&keys);
+    }
+}
+
+/* Consumer usages of every source, each once. Caller holds merge_mutex. */
+static void merge_consumer_publish(void)
+{
+    uint8_t payload[USB_CONSUMER_REPORT_SIZE] = {0};
+    uint8_t count = 0;
+
+    for (uint8_t s = 0; s < ARRAY_SIZE(merge_sources); s++) {
+        const struct merge_source *src = &merge_sources[s];
+
+        for (uint8_t i = 0; i < src->consumer_count &&
+                            count < USB_CONSUMER_REPORT_KEYS; i++) {
+            uint8_t j = 0;
+
+            while (j < count && sys_get_le16(&payload[j * 2]) != src->consumer[i]) {
+                j++;
+            }
+            if (j == count) {
+                sys_put_le16(src->consumer[i], &payload[count++ * 2]);
             }
         }
-        
-        /* Debug output - only log first few bytes to avoid spam */
-        LOG_DBG("HID Report (%u bytes): %02x %02x %02x %02x...",
-                length,
-                (length > 0) ? ((uint8_t*)data)[0] : 0,
-                (length > 1) ? ((uint8_t*)data)[1] : 0,
-                (length > 2) ? ((uint8_t*)data)[2] : 0,
-                (length > 3) ? ((uint8_t*)data)[3] : 0);
+    }
+
+    usb_bridge_report(USB_REPORT_CONSUMER, payload, sizeof(payload));
+}
+
+/* System control bits of every source. Caller holds merge_mutex. */
+static void merge_system_publish(void)
+{
+    uint8_t payload = 0;
+
+    for (uint8_t s = 0; s < ARRAY_SIZE(merge_sources); s++) {
+        payload |= merge_sources[s].system;
+    }
+
+    usb_bridge_report(USB_REPORT_SYSTEM, &payload, sizeof(payload));
+}
+
+/*
+ * Pointer report from one source, sent with the buttons held on every
+ * source. Caller holds merge_mutex.
+ */
+static void merge_pointer_publish(uint8_t source, uint8_t payload[USB_POINTER_REPORT_SIZE])
+{
+    merge_sources[source].buttons = payload[0];
+
+    for (uint8_t s = 0; s < ARRAY_SIZE(merge_sources); s++) {
+        payload[0] |= merge_sources[s].buttons;
+    }
+
+    usb_bridge_report(USB_REPORT_POINTER, payload, USB_POINTER_REPORT_SIZE);
+}
+
+/* Decode a keyboard report into the key state and publish what changed */
+static void hid_keyboard_report(const struct hids_report *report,
+                                const uint8_t *data, uint16_t length)
+{
+    struct key_state next;
+    bool valid;
+
+    if (report->info) {
+        valid = key_state_from_report(&next, report->map, report->info,
+                                      data, length);
     } else {
-        LOG_WRN("Received empty HID report");
+        /* Without a Report Map the fallback keyboard sends boot reports */
+        if (length != BOOT_REPORT_SIZE) {
+            LOG_WRN("Received HID report of %u bytes (expected %u)",
+                    length, BOOT_REPORT_SIZE);
+        }
+        valid = key_state_from_boot(&next, data, length);
+    }
+
+    /* ErrorRollOver: keep the previous state, as a host would */
+    if (!valid) {
+        LOG_DBG("Keyboard rollover, report ignored");
+        return;
     }
 
-    return BT_GATT_ITER_CONTINUE;
+    k_mutex_lock(&merge_mutex, K_FOREVER);
+    merge_sources[report->source].keys = next;
+    merge_keyboard_publish();
+    k_mutex_unlock(&merge_mutex);
 }
 
-/* Alternative: Direct subscription without auto-discovery */
-static void subscribe_to_reports(struct bt_conn *conn, uint16_t value_handle)
+/* Take a consumer report's usages into the USB 16-bit usage array */
+static void hid_consumer_report(const struct hids_report *report,
+                                const uint8_t *data, uint16_t length)
 {
-    /* Clear any existing subscription params */
-    memset(&subscribe_params, 0, sizeof(subscribe_params));
-    
-    /* Set up subscription */
-    subscribe_params.notify = notify_func;
-    subscribe_params.value = BT_GATT_CCC_NOTIFY;
-    subscribe_params.value_handle = value_handle;
-    subscribe_params.ccc_handle = value_handle + 1; /* CCC is typically next handle */
-    
-    int err = bt_gatt_subscribe(conn, &subscribe_params);
-    if (err && err != -EALREADY) {
-        LOG_ERR("Subscribe failed (err %d)", err);
-        
-        /* Try with auto-discovery if manual fails */
-        subscribe_params.ccc_handle = 0;
-        subscribe_params.end_handle = value_handle + 5;
-        err = bt_gatt_subscribe(conn, &subscribe_params);
-        if (err && err != -EALREADY) {
-            LOG_ERR("Subscribe with auto-discovery also failed (err %d)", err);
-        } else {
-            LOG_INF("Subscribed with auto-discovery");
+    struct merge_source *src = &merge_sources[report->source];
+    uint16_t usages[USB_CONSUMER_REPORT_KEYS];
+    uint8_t count = 0;
+
+    if (report->passthrough) {
+        /* Same layout: an array of 16-bit usages, 0 where none */
+        for (uint16_t i = 0; i + 1 < length && count < ARRAY_SIZE(usages); i += 2) {
+            uint16_t usage = sys_get_le16(&data[i]);
+
+            if (usage) {
+                usages[count++] = usage;
+            }
         }
     } else {
-        LOG_INF("Subscribed to HID reports");
+        count = report_map_collect_usages(report->map, report->info, data, length,
+                                          USAGE_PAGE_CONSUMER, usages,
+                                          ARRAY_SIZE(usages));
     }
-    
-    /* Clear discovery params as we're done with discovery */
-    memset(&discover_params, 0, sizeof(discover_params));
+
+    k_mutex_lock(&merge_mutex, K_FOREVER);
+    memcpy(src->consumer, usages, count * sizeof(usages[0]));
+    src->consumer_count = count;
+    merge_consumer_publish();
+    k_mutex_unlock(&merge_mutex);
 }
 
-/* GATT Discovery callbacks */
-static uint8_t discover_func(struct bt_conn *conn,
-                            const struct bt_gatt_attr *attr,
-                            struct bt_gatt_discover_params *params)
+/* Take a system control report into the USB power/sleep/wake bits */
+static void hid_system_report(const struct hids_report *report,
+                              const uint8_t *data, uint16_t length)
 {
-    static bool service_found = false;
-    static uint16_t service_handle = 0;
-    
-    if (!attr) {
-        if (params->type == BT_GATT_DISCOVER_PRIMARY) {
-            /* Finished discovering services, now discover characteristics */
-            if (service_found) {
-                LOG_INF("HID Service found, discovering characteristics...");
-                service_found = false;
-                
-                /* Reset discover params for characteristic discovery */
-                memset(&discover_params, 0, sizeof(discover_params));
-                discover_params.uuid = &uuid_report.uuid;
-                discover_params.func = discover_func;
-                discover_params.type = BT_GATT_DISCOVER_CHARACTERISTIC;
-                discover_params.start_handle = service_handle;
-                discover_params.end_handle = 0xffff;
-                
-                int err = bt_gatt_discover(conn, &discover_params);
-                if (err) {
-                    LOG_ERR("Discover characteristics failed (err %d)", err);
-                }
-                return BT_GATT_ITER_STOP;
+    uint16_t usages[3];
+    uint8_t bits = 0;
+    uint8_t count;
+
+    if (report->passthrough) {
+        bits = length ? data[0] : 0;
+    } else {
+        count = report_map_collect_usages(report->map, report->info, data, length,
+                                          USAGE_PAGE_GENERIC_DESKTOP, usages,
+                                          ARRAY_SIZE(usages));
+        for (uint8_t i = 0; i < count; i++) {
+            if (usages[i] >= USAGE_GD_SYSTEM_POWER_DOWN &&
+                usages[i] <= USAGE_GD_SYSTEM_WAKE_UP) {
+                bits |= BIT(usages[i] - USAGE_GD_SYSTEM_POWER_DOWN);
             }
         }
-        LOG_WRN("Discovery complete");
-        (void)memset(params, 0, sizeof(*params));
-        return BT_GATT_ITER_STOP;
     }
 
-    LOG_DBG("Discovered attr handle %u", attr->handle);
+    k_mutex_lock(&merge_mutex, K_FOREVER);
+    merge_sources[report->source].system = bits;
+    merge_system_publish();
+    k_mutex_unlock(&merge_mutex);
+}
+
+/* Read one relative pointer axis, clamped to the USB field's range */
+static int32_t hid_pointer_axis(const struct hids_report *report,
+                                const uint8_t *data, uint16_t length,
+                                uint16_t page, uint16_t usage, int32_t limit)
+{
+    int32_t value = 0;
 
-    if (params->type == BT_GATT_DISCOVER_PRIMARY) {
-        /* Found HID service */
-        if (bt_uuid_cmp(params->uuid, &uuid_hids.uuid) == 0) {
-            LOG_INF("Found HID Service at handle %u", attr->handle);
-            service_found = true;
-            service_handle = attr->handle;
+    report_map_get_value(report->map, report->info, data, length, page, usage,
+                         &value);
+    return CLAMP(value, -limit, limit);
+}
+
+/* Translate a mouse report into the USB pointer layout */
+static void hid_pointer_translate(const struct hids_report *report,
+                                  const uint8_t *data, uint16_t length,
+                                  uint8_t payload[USB_POINTER_REPORT_SIZE])
+{
+    uint16_t usages[USB_POINTER_BUTTONS];
+    uint8_t count;
+
+    count = report_map_collect_usages(report->map, report->info, data, length,
+                                      USAGE_PAGE_BUTTON, usages,
+                                      ARRAY_SIZE(usages));
+    for (uint8_t i = 0; i < count; i++) {
+        if (usages[i] >= 1 && usages[i] <= USB_POINTER_BUTTONS) {
+            payload[0] |= BIT(usages[i] - 1);
         }
-    } else if (params->type == BT_GATT_DISCOVER_CHARACTERISTIC) {
-        /* Found HID Report characteristic */
-        if (!bt_uuid_cmp(params->uuid, &uuid_report.uuid)) {
-            uint16_t value_handle = bt_gatt_attr_value_handle(attr);
-            LOG_INF("Found HID Report characteristic at handle %u", attr->handle);
-            LOG_INF("Value handle: %u", value_handle);
-            
-            /* Clear discovery params */
-            memset(&discover_params, 0, sizeof(discover_params));
-            
-            /* Use the alternative subscription function */
-            subscribe_to_reports(conn, value_handle);
-            
-            return BT_GATT_ITER_STOP;
+    }
+
+    sys_put_le16((uint16_t)hid_pointer_axis(report, data, length,
+                                            USAGE_PAGE_GENERIC_DESKTOP,
+                                            USAGE_GD_X, INT16_MAX),
+                 &payload[USB_POINTER_X]);
+    sys_put_le16((uint16_t)hid_pointer_axis(report, data, length,
+                                            USAGE_PAGE_GENERIC_DESKTOP,
+                                            USAGE_GD_Y, INT16_MAX),
+                 &payload[USB_POINTER_Y]);
+    payload[USB_POINTER_WHEEL] = (uint8_t)hid_pointer_axis(report, data, length,
+                                                           USAGE_PAGE_GENERIC_DESKTOP,
+                                                           USAGE_GD_WHEEL, INT8_MAX);
+    payload[USB_POINTER_PAN] = (uint8_t)hid_pointer_axis(report, data, length,
+                                                         USAGE_PAGE_CONSUMER,
+                                                         USAGE_CONSUMER_AC_PAN, INT8_MAX);
+}
+
+static void hid_pointer_report(const struct hids_report *report,
+                               const uint8_t *data, uint16_t length)
+{
+    uint8_t payload[USB_POINTER_REPORT_SIZE] = {0};
+
+    if (report->passthrough) {
+        memcpy(payload, data, MIN(length, sizeof(payload)));
+    } else {
+        hid_pointer_translate(report, data, length, payload);
+    }
+
+    k_mutex_lock(&merge_mutex, K_FOREVER);
+    merge_pointer_publish(report->source, payload);
+    k_mutex_unlock(&merge_mutex);
+}
+
+/* Input report from the keyboard - route it to the USB side */
+static void hid_input_report(const struct hids_report *report,
+                             const uint8_t *data, uint16_t length)
+{
+    /* Typing activity keeps the link on its fast parameters */
+    ble_link_activity();
+
+    /* Mirrored descriptor - the report goes out exactly as received */
+    if (usb_bridge_passthrough()) {
+        usb_bridge_forward(report->id, data, length);
+
+        /* Keep the boot view current for hosts in boot protocol */
+        if (report->route == REPORT_ROUTE_KEYBOARD) {
+            hid_keyboard_report(report, data, length);
         }
+        return;
     }
 
-    return BT_GATT_ITER_CONTINUE;
+    /* Forward to USB - queued or coalesced, never blocks BT RX */
+    switch (report->route) {
+    case REPORT_ROUTE_KEYBOARD:
+        hid_keyboard_report(report, data, length);
+        break;
+    case REPORT_ROUTE_CONSUMER:
+        hid_consumer_report(report, data, length);
+        break;
+    case REPORT_ROUTE_SYSTEM:
+        hid_system_report(report, data, length);
+        break;
+    case REPORT_ROUTE_POINTER:
+        hid_pointer_report(report, data, length);
+        break;
+    default:
+        LOG_DBG("Report ID %u not routed", report->id);
+        break;
+    }
+
+    /* Debug output - only log first few bytes to avoid spam */
+    LOG_DBG("HID Report ID %u (%u bytes): %02x %02x %02x %02x...",
+            report->id, length,
+            (length > 0) ? data[0] : 0,
+            (length > 1) ? data[1] : 0,
+            (length > 2) ? data[2] : 0,
+            (length > 3) ? data[3] : 0);
+}
+
+#if IS_ENABLED(CONFIG_BRIDGE_DESCRIPTOR_PASSTHROUGH)
+/* Store a new Report Map and restart so the host enumerates it */
+static void report_map_save_work_handler(struct k_work *work)
+{
+    int err = persist_save("ble_bridge/rmap", report_map_cache,
+                           report_map_cache_len);
+
+    /* Nothing pending may be lost to the reset */
+    if (!err) {
+        err = persist_flush();
+    }
+    if (err) {
+        LOG_ERR("Failed to save Report Map (err %d)", err);
+        return;
+    }
+
+    LOG_WRN("Keyboard Report Map changed, restarting to re-enumerate USB");
+    sys_reboot(SYS_REBOOT_COLD);
+}
+
+/* Report Map read from the keyboard - compare with the cached descriptor */
+static void hid_report_map(const uint8_t *desc, uint16_t len)
+{
+    if (len == report_map_cache_len && !memcmp(desc, report_map_cache, len)) {
+        return;
+    }
+
+    memcpy(report_map_cache, desc, len);
+    report_map_cache_len = len;
+    k_work_submit(&report_map_save_work);
 }
+#endif
 
-/* Forward declarations */
-void start_scan(void);
-void attempt_reconnect(void);
+static const struct hids_client_cb hids_cb = {
+#if IS_ENABLED(CONFIG_BRIDGE_DESCRIPTOR_PASSTHROUGH)
+    .report_map = hid_report_map,
+#endif
+    .bound = hid_report_bound,
+    .report = hid_input_report,
+    .ready = conn_mgr_ready,
+};
 
 /* BLE Security callbacks */
 static void auth_passkey_display(struct bt_conn *conn, unsigned int passkey)
@@ -324,10 +675,8 @@ static void pairing_complete(struct bt_conn *conn, bool bonded)
     LOG_INF("Pairing %s with %s", bonded ? "completed" : "failed", addr);
     
     if (bonded) {
-        /* Save that we're bonded for this device */
-        memcpy(&keyboard_addr, bt_conn_get_dst(conn), sizeof(keyboard_addr));
-        keyboard_paired = true;
-        settings_save_one("ble_bridge/addr", &keyboard_addr, sizeof(keyboard_addr));
+        /* Reconnect to the identity address from now on */
+        conn_mgr_bonded(conn);
     }
 }
 
@@ -354,14 +703,15 @@ static struct bt_conn_auth_info_cb auth_info_cb = {
 static int settings_set(const char *name, size_t len, settings_read_cb read_cb,
                        void *cb_arg)
 {
-    if (!strcmp(name, "addr")) {
-        if (len != sizeof(keyboard_addr)) {
+#if IS_ENABLED(CONFIG_BRIDGE_DESCRIPTOR_PASSTHROUGH)
+    if (!strcmp(name, "rmap")) {
+        if (len > sizeof(report_map_cache)) {
             return -EINVAL;
         }
-        read_cb(cb_arg, &keyboard_addr, sizeof(keyboard_addr));
-        keyboard_paired = true;
-        LOG_INF("Loaded saved keyboard address");
+        ssize_t ret = read_cb(cb_arg, report_map_cache, len);
+        report_map_cache_len = ret > 0 ? (uint16_t)ret : 0;
     }
+#endif
     return 0;
 }
 
@@ -370,319 +720,86 @@ static struct settings_handler conf = {
     .h_set = settings_set
 };
 
-/* BLE Connection callbacks */
-static void connected(struct bt_conn *conn, uint8_t err)
-{
-    char addr[BT_ADDR_LE_STR_LEN];
-
-    bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
-
-    if (err) {
-        LOG_ERR("Failed to connect to %s (%u)", addr, err);
-        
-        k_mutex_lock(&conn_mutex, K_FOREVER);
-        if (current_conn) {
-            bt_conn_unref(current_conn);
-            current_conn = NULL;
-        }
-        k_mutex_unlock(&conn_mutex);
-        
-        /* Try to reconnect */
-        k_sleep(K_SECONDS(1));
-        if (keyboard_paired) {
-            attempt_reconnect();
-        } else {
-            start_scan();
-        }
-        return;
-    }
-
-    LOG_INF("Connected: %s", addr);
-    
-    k_mutex_lock(&conn_mutex, K_FOREVER);
-    current_conn = bt_conn_ref(conn);
-    k_mutex_unlock(&conn_mutex);
-    
-    /* Save keyboard address for reconnection */
-    memcpy(&keyboard_addr, bt_conn_get_dst(conn), sizeof(keyboard_addr));
-    keyboard_paired = true;
-    settings_save_one("ble_bridge/addr", &keyboard_addr, sizeof(keyboard_addr));
-    
-    /* Set security level for encrypted connection */
-    int sec_err = bt_conn_set_security(conn, BT_SECURITY_L2);
-    if (sec_err) {
-        LOG_WRN("Failed to set security level: %d", sec_err);
-        /* Continue anyway - keyboard might not require encryption */
-        /* Start discovery immediately */
-        discover_params.uuid = &uuid_hids.uuid;
-        discover_params.func = discover_func;
-        discover_params.start_handle = BT_ATT_FIRST_ATTRIBUTE_HANDLE;
-        discover_params.end_handle = BT_ATT_LAST_ATTRIBUTE_HANDLE;
-        discover_params.type = BT_GATT_DISCOVER_PRIMARY;
-
-        err = bt_gatt_discover(conn, &discover_params);
-        if (err) {
-            LOG_ERR("Discover failed (err %d)", err);
-        }
-    } else {
-        LOG_INF("Security level set to L2 (encrypted) - waiting for security");
-        /* Discovery will be triggered in security_changed callback */
-    }
-}
-
-static void disconnected(struct bt_conn *conn, uint8_t reason)
-{
-    char addr[BT_ADDR_LE_STR_LEN];
-
-    bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
-    LOG_INF("Disconnected: %s (reason %u)", addr, reason);
-
-    k_mutex_lock(&conn_mutex, K_FOREVER);
-    if (current_conn) {
-        bt_conn_unref(current_conn);
-        current_conn = NULL;
-    }
-    k_mutex_unlock(&conn_mutex);
-    
-    /* Clear discovery state */
-    memset(&discover_params, 0, sizeof(discover_params));
-    memset(&subscribe_params, 0, sizeof(subscribe_params));
-
-    /* Clear HID report on disconnect - but only if USB is ready */
-    if (usb_configured && hid_dev) {
-        memset(hid_report, 0, sizeof(hid_report));
-        int ret = hid_int_ep_write(hid_dev, hid_report, sizeof(hid_report), NULL);
-        if (ret < 0 && ret != -EAGAIN) {
-            LOG_ERR("Failed to send clear report: %d", ret);
-        }
-    }
-
-    /* Try to reconnect to the same keyboard */
-    k_sleep(K_SECONDS(1));
-    if (keyboard_paired) {
-        LOG_INF("Attempting to reconnect to saved keyboard");
-        attempt_reconnect();
-    } else {
-        start_scan();
-    }
-}
-
-static void security_changed(struct bt_conn *conn, bt_security_t level,
-                            enum bt_security_err err)
+/* Device link gone - release only what it was holding on the host */
+static void device_disconnected(uint8_t source)
 {
-    char addr[BT_ADDR_LE_STR_LEN];
-    bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
-    
-    if (!err) {
-        LOG_INF("Security changed: %s level %u", addr, level);
-        
-        /* If we just established security and haven't started discovery yet, do it now */
-        if (level >= BT_SECURITY_L2 && discover_params.func == NULL) {
-            LOG_INF("Security established, starting HID service discovery");
-            
-            discover_params.uuid = &uuid_hids.uuid;
-            discover_params.func = discover_func;
-            discover_params.start_handle = BT_ATT_FIRST_ATTRIBUTE_HANDLE;
-            discover_params.end_handle = BT_ATT_LAST_ATTRIBUTE_HANDLE;
-            discover_params.type = BT_GATT_DISCOVER_PRIMARY;
-
-            int disc_err = bt_gatt_discover(conn, &discover_params);
-            if (disc_err) {
-                LOG_ERR("Discover failed after security (err %d)", disc_err);
-            }
-        }
-    } else {
-        LOG_ERR("Security failed: %s level %u err %d", addr, level, err);
-    }
+    uint8_t pointer[USB_POINTER_REPORT_SIZE] = {0};
+
+    k_mutex_lock(&led_mutex, K_FOREVER);
+    led_sinks[source].report = NULL;
+    k_mutex_unlock(&led_mutex);
+
+    /* Delivered even under backpressure; the other sources keep their share */
+    k_mutex_lock(&merge_mutex, K_FOREVER);
+    memset(&merge_sources[source], 0, sizeof(merge_sources[source]));
+    merge_keyboard_publish();
+    merge_consumer_publish();
+    merge_system_publish();
+    merge_pointer_publish(source, pointer);
+    k_mutex_unlock(&merge_mutex);
 }
 
-BT_CONN_CB_DEFINE(conn_callbacks) = {
-    .connected = connected,
-    .disconnected = disconnected,
-    .security_changed = security_changed,
+static const struct conn_mgr_cb conn_cb = {
+    .disconnected = device_disconnected,
 };
 
-/* BLE Scanning */
-static bool device_found(struct bt_data *data, void *user_data)
-{
-    bt_addr_le_t *addr = user_data;
-    char name[30];
-
-    if (data->type == BT_DATA_NAME_COMPLETE ||
-        data->type == BT_DATA_NAME_SHORTENED) {
-        
-        memcpy(name, data->data, MIN(data->data_len, sizeof(name) - 1));
-        name[MIN(data->data_len, sizeof(name) - 1)] = '\0';
-
-        LOG_DBG("Found device: %s", name);
-
-        /* Check if this is our target keyboard */
-        if (strstr(name, TARGET_DEVICE_NAME) ||
-            strstr(name, TARGET_DEVICE_NAME_ALT) ||
-            strstr(name, TARGET_DEVICE_NAME_ALT2)) {
-            
-            LOG_INF("Found Kinesis keyboard: %s", name);
-            
-            /* Stop scanning and connect */
-            int err = bt_le_scan_stop();
-            if (err) {
-                LOG_ERR("Stop scan failed (err %d)", err);
-                return true;
-            }
-
-            /* Small delay to ensure scan is stopped */
-            k_sleep(K_MSEC(100));
-
-            /* Create connection */
-            struct bt_conn *conn = NULL;
-            struct bt_le_conn_param *param = BT_LE_CONN_PARAM_DEFAULT;
-            
-            err = bt_conn_le_create(addr, BT_CONN_LE_CREATE_CONN,
-                                   param, &conn);
-            if (err) {
-                LOG_ERR("Create connection failed (err %d)", err);
-                k_sleep(K_SECONDS(1));
-                start_scan();
-            } else if (conn) {
-                /* Connection initiated successfully */
-                bt_conn_unref(conn);
-            }
-
-            return false; /* Stop parsing */
-        }
-    }
-
-    return true; /* Continue parsing */
-}
-
-static void scan_cb(const bt_addr_le_t *addr, int8_t rssi, uint8_t type,
-                    struct net_buf_simple *ad)
-{
-    /* Parse advertisement data */
-    bt_data_parse(ad, device_found, (void *)addr);
-}
-
-void start_scan(void)
+/*
+ * Bluetooth up, on the system workqueue. Only the bonds and identity are
+ * loaded before reconnecting; the connection manager reads the profile
+ * table itself.
+ */
+static void bt_ready(int err)
 {
-    int err;
-
-    k_mutex_lock(&conn_mutex, K_FOREVER);
-    bool already_connected = (current_conn != NULL);
-    k_mutex_unlock(&conn_mutex);
-    
-    if (already_connected) {
-        LOG_DBG("Already connected, not scanning");
-        return;
-    }
-
-    struct bt_le_scan_param scan_param = {
-        .type       = BT_LE_SCAN_TYPE_ACTIVE,
-        .options    = BT_LE_SCAN_OPT_NONE,
-        .interval   = BT_GAP_SCAN_FAST_INTERVAL,
-        .window     = BT_GAP_SCAN_FAST_WINDOW,
-    };
-
-    err = bt_le_scan_start(&scan_param, scan_cb);
     if (err) {
-        LOG_ERR("Scanning failed to start (err %d)", err);
+        LOG_ERR("Bluetooth init failed: %d", err);
         return;
     }
 
-    LOG_INF("Scanning for Kinesis keyboard...");
-}
-
-void attempt_reconnect(void)
-{
-    k_mutex_lock(&conn_mutex, K_FOREVER);
-    bool already_connected = (current_conn != NULL);
-    k_mutex_unlock(&conn_mutex);
-    
-    if (already_connected) {
-        LOG_DBG("Already connected");
-        return;
-    }
+    boot_mark(&boot.bt_ready);
+    LOG_INF("Bluetooth initialized");
 
-    if (!keyboard_paired) {
-        LOG_INF("No saved keyboard, starting scan");
-        start_scan();
-        return;
-    }
+    settings_load_subtree("bt");
 
-    LOG_INF("Attempting direct reconnection to saved keyboard");
-    
-    struct bt_conn *conn = NULL;
-    struct bt_le_conn_param *param = BT_LE_CONN_PARAM_DEFAULT;
-    
-    int err = bt_conn_le_create(&keyboard_addr, BT_CONN_LE_CREATE_CONN,
-                                param, &conn);
-    if (err) {
-        LOG_ERR("Direct reconnection failed (err %d), starting scan", err);
-        start_scan();
-    } else if (conn) {
-        LOG_INF("Direct reconnection initiated");
-        bt_conn_unref(conn);
-    }
+    /* Reconnect to saved keyboard or start scanning */
+    conn_mgr_start();
 }
 
 /* Button work handler - runs in system workqueue context */
 #if DT_NODE_HAS_STATUS(SW0_NODE, okay)
 static void button_work_handler(struct k_work *work)
 {
-    if (button_double_press) {
-        LOG_INF("Double press detected - clearing pairing and restarting");
-        
-        /* Disconnect if connected */
-        k_mutex_lock(&conn_mutex, K_FOREVER);
-        if (current_conn) {
-            bt_conn_disconnect(current_conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
-            bt_conn_unref(current_conn);
-            current_conn = NULL;
-        }
-        k_mutex_unlock(&conn_mutex);
-        
-        /* Clear saved keyboard address */
-        keyboard_paired = false;
-        memset(&keyboard_addr, 0, sizeof(keyboard_addr));
-        
-        /* Clear settings */
-        settings_save_one("ble_bridge/addr", NULL, 0);
-        
-        /* Start fresh scan after a delay */
-        k_sleep(K_MSEC(100));
-        start_scan();
-        
-        button_double_press = false;
-    } else {
-        LOG_INF("Single press - attempting reconnect");
-        
-        /* Single press - try to reconnect */
-        k_mutex_lock(&conn_mutex, K_FOREVER);
-        bool should_reconnect = (!current_conn && keyboard_paired);
-        k_mutex_unlock(&conn_mutex);
-        
-        if (should_reconnect) {
-            attempt_reconnect();
-        }
+    atomic_val_t presses = atomic_set(&button_presses, 0);
+
+    switch (presses) {
+    case 0:
+        break;
+    case 1:
+        LOG_INF("Single press - reconnecting or pairing another device");
+
+        /* Reconnect now, or look for one more device while linked */
+        conn_mgr_reconnect();
+        break;
+    case 2:
+        LOG_INF("Double press - switching to the next stored keyboard");
+        conn_mgr_switch_next();
+        break;
+    default:
+        LOG_INF("Triple press - clearing all pairings and scanning for a keyboard");
+
+        /* Disconnect, forget every device and scan for a new one */
+        conn_mgr_forget();
+        break;
     }
 }
 
-/* Button ISR handler - minimal work, just schedules the work item */
+/* Button ISR handler - minimal work, the gesture is read once presses stop */
 static void button_pressed(const struct device *dev, struct gpio_callback *cb,
                           uint32_t pins)
 {
-    uint64_t now = k_uptime_get();
-    
-    /* Detect double press (within 500ms) */
-    if ((now - button_press_time) < 500) {
-        button_double_press = true;
-    } else {
-        button_double_press = false;
-    }
-    
-    button_press_time = now;
-    
+    atomic_inc(&button_presses);
+
     /* Submit work to system workqueue - non-blocking */
-    k_work_submit(&button_work);
+    k_work_reschedule(&button_work, K_MSEC(BUTTON_GESTURE_MS));
 }
 #endif
 
@@ -723,44 +840,22 @@ int main(void)
     }
     
     /* Initialize button work item */
-    k_work_init(&button_work, button_work_handler);
+    k_work_init_delayable(&button_work, button_work_handler);
     
     /* Set up GPIO callback */
     gpio_init_callback(&button_cb_data, button_pressed, BIT(button.pin));
     gpio_add_callback(button.port, &button_cb_data);
 #endif
 
-    /* Initialize USB HID */
-    hid_dev = device_get_binding("HID_0");
-    if (!hid_dev) {
-        LOG_ERR("Cannot get HID device");
-        return -1;
-    }
-
-    usb_hid_register_device(hid_dev, hid_report_desc, sizeof(hid_report_desc),
-                           &hid_ops);
-
-    err = usb_hid_init(hid_dev);
-    if (err) {
-        LOG_ERR("Failed to init USB HID: %d", err);
-        return -1;
-    }
-
-    err = usb_enable(usb_hid_status_cb);
-    if (err) {
-        LOG_ERR("Failed to enable USB: %d", err);
-        return -1;
-    }
+    hids_client_init(&hids_cb);
+    ble_link_init();
+    conn_mgr_init(&conn_cb);
+    k_work_init_delayable(&led_work, led_work_handler);
 
-    /* Initialize Bluetooth */
-    err = bt_enable(NULL);
-    if (err) {
-        LOG_ERR("Bluetooth init failed: %d", err);
-        return -1;
-    }
+    /* Register settings handler */
+    settings_subsys_init();
+    settings_register(&conf);
 
-    LOG_INF("Bluetooth initialized");
-    
     /* Register security callbacks */
     err = bt_conn_auth_cb_register(&auth_cb_display);
     if (err) {
@@ -774,21 +869,34 @@ int main(void)
     
     LOG_INF("Security callbacks registered");
 
-    /* Register settings handler */
-    settings_subsys_init();
-    settings_register(&conf);
-    
-    /* Load settings including bonds */
-    settings_load();
-
-    /* Try to reconnect to saved keyboard or start scanning */
-    k_sleep(K_SECONDS(1));
-    if (keyboard_paired) {
-        LOG_INF("Found saved keyboard, attempting reconnection");
-        attempt_reconnect();
-    } else {
-        LOG_INF("No saved keyboard, starting scan");
-        start_scan();
+#if IS_ENABLED(CONFIG_BRIDGE_DESCRIPTOR_PASSTHROUGH)
+    /*
+     * The cached Report Map is needed before USB enumerates. Loaded before
+     * Bluetooth comes up, so it is done before the connection manager
+     * reads its own settings on the system workqueue.
+     */
+    k_work_init(&report_map_save_work, report_map_save_work_handler);
+    settings_load_subtree("ble_bridge");
+    if (report_map_cache_len) {
+        err = usb_bridge_set_descriptor(report_map_cache, report_map_cache_len);
+        if (err) {
+            LOG_WRN("Cached Report Map not usable (err %d), using fixed descriptor",
+                    err);
+        }
+    }
+#endif
+
+    /* Bring Bluetooth up on the system workqueue while USB enumerates */
+    err = bt_enable(bt_ready);
+    if (err) {
+        LOG_ERR("Bluetooth init failed: %d", err);
+        return -1;
+    }
+
+    /* Initialize USB HID */
+    err = usb_bridge_init(&usb_cb);
+    if (err) {
+        return -1;
     }
 
     /* Main loop */
@@ -796,11 +904,7 @@ int main(void)
         k_sleep(K_SECONDS(1));
         
         /* Blink LED if not connected */
-        k_mutex_lock(&conn_mutex, K_FOREVER);
-        bool is_connected = (current_conn != NULL);
-        k_mutex_unlock(&conn_mutex);
-        
-        if (!is_connected) {
+        if (!conn_mgr_connected()) {
 #if DT_NODE_HAS_STATUS(LED0_NODE, okay)
             gpio_pin_toggle_dt(&led);
 #endif
@@ -0,0 +1,361 @@
+/*
+ * Deferred settings writes
+ *
+ * Pending values live in a small fixed table, their data in a dedicated
+ * heap. An entry stays in the table while the flush writes it, marked
+ * busy, so a read in the meantime still finds it; saving the same key then
+ * adds a newer entry instead of touching the busy one. With the table or
+ * the heap full, a value is written on the caller's thread once any flush
+ * under way is done, still skipped if it is already stored.
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/fs/nvs.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/settings/settings.h>
+
+#include "persist.h"
+
+LOG_MODULE_DECLARE(ble_bridge, LOG_LEVEL_INF);
+
+struct persist_entry {
+    char key[SETTINGS_MAX_NAME_LEN];
+    void *value;            /* From persist_heap, NULL for a delete */
+    size_t len;
+    bool used;
+    bool busy;              /* Being written by the flush */
+};
+
+K_HEAP_DEFINE(persist_heap, CONFIG_BRIDGE_SETTINGS_HEAP_SIZE);
+static K_MUTEX_DEFINE(persist_lock);
+static K_MUTEX_DEFINE(flush_lock);      /* One flush at a time */
+static struct persist_entry entries[CONFIG_BRIDGE_SETTINGS_PENDING];   /* Guarded by persist_lock */
+static struct persist_stats stats;      /* Counters guarded by persist_lock */
+
+/*
+ * Stored value read back for the compare before a write, guarded by
+ * flush_lock. A settings read always starts at the beginning of the value,
+ * so it cannot be compared piecewise; anything that could be deferred fits.
+ */
+static uint8_t probe_buf[CONFIG_BRIDGE_SETTINGS_HEAP_SIZE];
+
+static void flush_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(flush_work, flush_work_handler);
+static int persist_direct(const char *key, const void *value, size_t len);
+
+/* Pending entry for key; with busy, one being written is fine too */
+static struct persist_entry *persist_find(const char *key, bool busy)
+{
+    for (uint8_t i = 0; i < ARRAY_SIZE(entries); i++) {
+        struct persist_entry *entry = &entries[i];
+
+        if (entry->used && entry->busy == busy && !strcmp(entry->key, key)) {
+            return entry;
+        }
+    }
+
+    return busy ? NULL : persist_find(key, true);
+}
+
+static void persist_release(struct persist_entry *entry)
+{
+    if (entry->value) {
+        k_heap_free(&persist_heap, entry->value);
+    }
+    memset(entry, 0, sizeof(*entry));
+}
+
+/* Pending entry for a save or delete, NULL if it has to be written now */
+static struct persist_entry *persist_claim(const char *key)
+{
+    struct persist_entry *entry = persist_find(key, false);
+
+    stats.requests++;
+
+    if (entry && !entry->busy) {
+        stats.coalesced++;
+        persist_release(entry);
+    } else {
+        entry = NULL;
+        for (uint8_t i = 0; i < ARRAY_SIZE(entries); i++) {
+            if (!entries[i].used) {
+                entry = &entries[i];
+                break;
+            }
+        }
+    }
+
+    if (!entry || strlen(key) >= sizeof(entry->key)) {
+        stats.direct++;
+        return NULL;
+    }
+
+    strcpy(entry->key, key);
+    entry->used = true;
+    return entry;
+}
+
+static void persist_schedule(void)
+{
+    k_work_schedule(&flush_work, K_MSEC(CONFIG_BRIDGE_SETTINGS_FLUSH_MS));
+}
+
+int persist_save(const char *key, const void *value, size_t len)
+{
+    struct persist_entry *entry;
+    void *copy;
+
+    if (!len) {
+        return persist_delete(key);
+    }
+
+    copy = k_heap_alloc(&persist_heap, len, K_NO_WAIT);
+
+    k_mutex_lock(&persist_lock, K_FOREVER);
+    entry = persist_claim(key);
+    if (entry && !copy) {
+        /* Drops any older pending value along with it */
+        stats.direct++;
+        persist_release(entry);
+        entry = NULL;
+    }
+    if (!entry) {
+        k_mutex_unlock(&persist_lock);
+        if (copy) {
+            k_heap_free(&persist_heap, copy);
+        }
+        return persist_direct(key, value, len);
+    }
+
+    memcpy(copy, value, len);
+    entry->value = copy;
+    entry->len = len;
+    k_mutex_unlock(&persist_lock);
+
+    persist_schedule();
+    return 0;
+}
+
+int persist_delete(const char *key)
+{
+    struct persist_entry *entry;
+
+    k_mutex_lock(&persist_lock, K_FOREVER);
+    entry = persist_claim(key);
+    k_mutex_unlock(&persist_lock);
+
+    if (!entry) {
+        return persist_direct(key, NULL, 0);
+    }
+
+    persist_schedule();
+    return 0;
+}
+
+struct persist_load {
+    void *buf;
+    size_t size;
+    const void *value;      /* Compare with this instead of copying */
+    ssize_t ret;
+};
+
+static int persist_load_cb(const char *key, size_t len, settings_read_cb read_cb,
+                           void *cb_arg, void *param)
+{
+    struct persist_load *load = param;
+    const char *next;
+
+    /* Exact key only */
+    if (settings_name_next(key, &next) != 0) {
+        return 0;
+    }
+
+    if (len > load->size) {
+        load->ret = -ENOSPC;
+        return 0;
+    }
+
+    load->ret = read_cb(cb_arg, load->buf, len);
+    if (load->value && load->ret == (ssize_t)len &&
+        memcmp(load->buf, load->value, len)) {
+        load->ret = -ENOENT;
+    }
+    return 0;
+}
+
+ssize_t persist_read(const char *key, void *buf, size_t size)
+{
+    struct persist_load load = {
+        .buf = buf,
+        .size = size,
+        .ret = -ENOENT,
+    };
+    struct persist_entry *entry;
+
+    k_mutex_lock(&persist_lock, K_FOREVER);
+    entry = persist_find(key, false);
+    if (entry) {
+        if (entry->len > size) {
+            load.ret = -ENOSPC;
+        } else if (entry->len) {
+            memcpy(buf, entry->value, entry->len);
+            load.ret = entry->len;
+        }
+        k_mutex_unlock(&persist_lock);
+        return load.ret;
+    }
+    k_mutex_unlock(&persist_lock);
+
+    settings_load_subtree_direct(key, persist_load_cb, &load);
+    return load.ret;
+}
+
+/*
+ * Pending value matches the stored one; a delete matches a missing key.
+ * Caller holds flush_lock.
+ */
+static bool persist_stored(const struct persist_entry *entry)
+{
+    struct persist_load load = {
+        .buf = probe_buf,
+        .size = entry->len,
+        .value = entry->value,
+        .ret = -ENOENT,
+    };
+
+    /* Too large to read back: just write it */
+    if (entry->len > sizeof(probe_buf)) {
+        return false;
+    }
+
+    /* A delete only has to find the key; a size of 0 is enough to tell */
+    settings_load_subtree_direct(entry->key, persist_load_cb, &load);
+    return entry->len ? load.ret == (ssize_t)entry->len : load.ret == -ENOENT;
+}
+
+/* Write a value unless it is already stored. Caller holds flush_lock. */
+static int persist_store(const struct persist_entry *entry)
+{
+    uint32_t *counter = entry->len ? &stats.writes : &stats.deletes;
+    int err = 0;
+
+    if (persist_stored(entry)) {
+        counter = &stats.unchanged;
+    } else if (entry->len) {
+        err = settings_save_one(entry->key, entry->value, entry->len);
+    } else {
+        err = settings_delete(entry->key);
+    }
+
+    if (err) {
+        LOG_WRN("Failed to write setting %s (err %d)", entry->key, err);
+        counter = &stats.failures;
+    }
+
+    k_mutex_lock(&persist_lock, K_FOREVER);
+    (*counter)++;
+    k_mutex_unlock(&persist_lock);
+
+    return err;
+}
+
+/* Write one entry, busy so nothing else touches it meanwhile */
+static int persist_write(struct persist_entry *entry)
+{
+    int err = persist_store(entry);
+
+    k_mutex_lock(&persist_lock, K_FOREVER);
+    persist_release(entry);
+    k_mutex_unlock(&persist_lock);
+
+    return err;
+}
+
+/*
+ * No room to defer: write on the caller's thread, after any flush under
+ * way so an older value of the same key cannot land last
+ */
+static int persist_direct(const char *key, const void *value, size_t len)
+{
+    struct persist_entry entry = {
+        .value = (void *)value,
+        .len = len,
+    };
+    int err;
+
+    if (strlen(key) >= sizeof(entry.key)) {
+        return len ? settings_save_one(key, value, len) : settings_delete(key);
+    }
+    strcpy(entry.key, key);
+
+    k_mutex_lock(&flush_lock, K_FOREVER);
+    err = persist_store(&entry);
+    k_mutex_unlock(&flush_lock);
+
+    return err;
+}
+
+int persist_flush(void)
+{
+    uint32_t flushed = 0;
+    int ret = 0;
+
+    k_mutex_lock(&flush_lock, K_FOREVER);
+
+    for (uint8_t i = 0; i < ARRAY_SIZE(entries); i++) {
+        struct persist_entry *entry = &entries[i];
+        int err;
+
+        k_mutex_lock(&persist_lock, K_FOREVER);
+        if (!entry->used || entry->busy) {
+            k_mutex_unlock(&persist_lock);
+            continue;
+        }
+        entry->busy = true;
+        k_mutex_unlock(&persist_lock);
+
+        err = persist_write(entry);
+        if (err) {
+            ret = err;
+        }
+        flushed++;
+    }
+
+    k_mutex_unlock(&flush_lock);
+
+    if (flushed) {
+        struct persist_stats now;
+
+        persist_stats_get(&now);
+        LOG_INF("Settings flushed: %u written, %u deleted, %u unchanged, "
+                "%d bytes free", now.writes, now.deletes, now.unchanged,
+                now.free_bytes);
+    }
+    return ret;
+}
+
+static void flush_work_handler(struct k_work *work)
+{
+    persist_flush();
+}
+
+void persist_stats_get(struct persist_stats *out)
+{
+    k_mutex_lock(&persist_lock, K_FOREVER);
+    *out = stats;
+    k_mutex_unlock(&persist_lock);
+
+    out->free_bytes = -ENOTSUP;
+
+#if IS_ENABLED(CONFIG_SETTINGS_NVS)
+    struct nvs_fs *fs;
+
+    if (settings_storage_get((void **)&fs) || !fs) {
+        return;
+    }
+
+    out->free_bytes = nvs_calc_free_space(fs);
+    out->sector_size = fs->sector_size;
+    out->sector_count = fs->sector_count;
+#endif
+}
@@ -0,0 +1,46 @@
+/*
+ * Deferred settings writes
+ *
+ * Values saved through here are copied to RAM and written to settings by
+ * the system workqueue CONFIG_BRIDGE_SETTINGS_FLUSH_MS after the first
+ * change, so connecting or pairing never waits on flash. A key saved
+ * again before then only replaces the pending copy, and a value that
+ * matches what is already stored is not written at all. Reads see the
+ * pending copy first.
+ */
+
+#ifndef PERSIST_H_
+#define PERSIST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct persist_stats {
+    uint32_t requests;      /* Saves and deletes asked for */
+    uint32_t coalesced;     /* Replaced a pending one for the same key */
+    uint32_t unchanged;     /* Dropped at the flush, already stored */
+    uint32_t writes;        /* Values written */
+    uint32_t deletes;       /* Values deleted */
+    uint32_t direct;        /* Written on the caller's thread, no room to defer */
+    uint32_t failures;
+    int32_t free_bytes;     /* NVS space left, negative errno if unknown */
+    uint16_t sector_size;   /* NVS geometry, 0 if unknown */
+    uint16_t sector_count;
+};
+
+/* Queue a value; written at the next flush unless it is already stored */
+int persist_save(const char *key, const void *value, size_t len);
+
+/* Queue the removal of a value */
+int persist_delete(const char *key);
+
+/* Value of a key, pending or stored: its length, -ENOENT or -ENOSPC */
+ssize_t persist_read(const char *key, void *buf, size_t size);
+
+/* Write everything pending now, e.g. before a reset; 0 or the last error */
+int persist_flush(void);
+
+void persist_stats_get(struct persist_stats *stats);
+
+#endif /* PERSIST_H_ */
@@ -0,0 +1,454 @@
+/*
+ * Keyboard profile table
+ *
+ * Slots are saved one at a time, when a keyboard connects, bonds or
+ * settles on new connection parameters, through persist so a reconnect
+ * never waits on flash. Recency is a use counter rather than a time, as there
+ * is no wall clock; it carries on from the highest value loaded.
+ */
+
+#include <stdlib.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/settings/settings.h>
+
+#include "profiles.h"
+#include "hids_client.h"
+#include "persist.h"
+
+#if IS_ENABLED(CONFIG_BRIDGE_PROFILE_SHELL)
+#include <zephyr/shell/shell.h>
+#include "ble_link.h"
+#include "conn_mgr.h"
+#endif
+
+LOG_MODULE_DECLARE(ble_bridge, LOG_LEVEL_INF);
+
+BUILD_ASSERT(CONFIG_BRIDGE_PROFILE_SLOTS >= CONFIG_BRIDGE_MAX_DEVICES,
+             "BRIDGE_PROFILE_SLOTS must cover BRIDGE_MAX_DEVICES");
+BUILD_ASSERT(CONFIG_BRIDGE_PROFILE_SLOTS <= CONFIG_BT_MAX_PAIRED,
+             "BRIDGE_PROFILE_SLOTS needs as many BT_MAX_PAIRED");
+BUILD_ASSERT(CONFIG_BRIDGE_PROFILE_SLOTS < PROFILE_NONE);
+
+#define PROFILE_KEY_PREFIX "ble_bridge/prof"
+
+static struct k_spinlock profiles_lock;
+static struct profile profiles[CONFIG_BRIDGE_PROFILE_SLOTS];   /* Guarded by profiles_lock */
+static uint32_t profiles_seq;           /* Highest last_used handed out */
+
+static bool profile_used(const struct profile *prof)
+{
+    return prof->last_used != 0;
+}
+
+static void profile_save(uint8_t slot)
+{
+    char key[SETTINGS_MAX_NAME_LEN];
+    struct profile prof;
+    int err;
+
+    profiles_get(slot, &prof);
+    snprintk(key, sizeof(key), PROFILE_KEY_PREFIX "/%u", slot);
+
+    if (profile_used(&prof)) {
+        err = persist_save(key, &prof, sizeof(prof));
+    } else {
+        err = persist_delete(key);
+    }
+    if (err) {
+        LOG_WRN("Failed to save profile %u (err %d)", slot, err);
+    }
+}
+
+/* Free a slot in RAM and in settings, leaving the bond alone */
+static void profile_release(uint8_t slot)
+{
+    k_spinlock_key_t key = k_spin_lock(&profiles_lock);
+
+    memset(&profiles[slot], 0, sizeof(profiles[slot]));
+    k_spin_unlock(&profiles_lock, key);
+    profile_save(slot);
+}
+
+static bool profile_connected(const struct profile *prof)
+{
+    struct bt_conn *conn = bt_conn_lookup_addr_le(BT_ID_DEFAULT, &prof->addr);
+
+    if (!conn) {
+        return false;
+    }
+    bt_conn_unref(conn);
+    return true;
+}
+
+static int profile_load_cb(const char *key, size_t len, settings_read_cb read_cb,
+                           void *cb_arg, void *param)
+{
+    struct profile prof;
+    unsigned long slot;
+    char *end;
+
+    slot = strtoul(key, &end, 10);
+    if (end == key || *end || slot >= ARRAY_SIZE(profiles) || len != sizeof(prof)) {
+        /* Another slot count or layout: not ours to keep */
+        return 0;
+    }
+
+    if (read_cb(cb_arg, &prof, sizeof(prof)) != sizeof(prof) || !profile_used(&prof)) {
+        return 0;
+    }
+
+    profiles[slot] = prof;
+    profiles_seq = MAX(profiles_seq, prof.last_used);
+    return 0;
+}
+
+/* The single keyboard stored before there was a table */
+struct legacy_addr {
+    bt_addr_le_t addr;
+    bool found;
+};
+
+static int legacy_addr_load_cb(const char *key, size_t len, settings_read_cb read_cb,
+                               void *cb_arg, void *param)
+{
+    struct legacy_addr *legacy = param;
+
+    if (len == sizeof(legacy->addr) &&
+        read_cb(cb_arg, &legacy->addr, sizeof(legacy->addr)) == sizeof(legacy->addr)) {
+        legacy->found = true;
+    }
+    return 0;
+}
+
+void profiles_load(void)
+{
+    struct legacy_addr legacy = {0};
+
+    settings_load_subtree_direct(PROFILE_KEY_PREFIX, profile_load_cb, NULL);
+
+    settings_load_subtree_direct("ble_bridge/addr", legacy_addr_load_cb, &legacy);
+    if (legacy.found) {
+        uint8_t slot = profiles_use(&legacy.addr);
+
+        if (slot != PROFILE_NONE &&
+            bt_le_bond_exists(BT_ID_DEFAULT, &legacy.addr)) {
+            profiles_bonded(slot, &legacy.addr);
+        }
+        persist_delete("ble_bridge/addr");
+    }
+
+    LOG_INF("%u of %u keyboard profiles stored", profiles_count(),
+            CONFIG_BRIDGE_PROFILE_SLOTS);
+}
+
+uint8_t profiles_count(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&profiles_lock);
+    uint8_t count = 0;
+
+    for (uint8_t i = 0; i < ARRAY_SIZE(profiles); i++) {
+        count += profile_used(&profiles[i]);
+    }
+    k_spin_unlock(&profiles_lock, key);
+
+    return count;
+}
+
+int profiles_get(uint8_t slot, struct profile *profile)
+{
+    k_spinlock_key_t key;
+    int err = 0;
+
+    if (slot >= ARRAY_SIZE(profiles)) {
+        return -EINVAL;
+    }
+
+    key = k_spin_lock(&profiles_lock);
+    *profile = profiles[slot];
+    k_spin_unlock(&profiles_lock, key);
+
+    if (!profile_used(profile)) {
+        err = -ENOENT;
+    }
+    return err;
+}
+
+uint8_t profiles_find(const bt_addr_le_t *addr)
+{
+    k_spinlock_key_t key = k_spin_lock(&profiles_lock);
+    uint8_t slot = PROFILE_NONE;
+
+    for (uint8_t i = 0; i < ARRAY_SIZE(profiles); i++) {
+        if (profile_used(&profiles[i]) && bt_addr_le_eq(&profiles[i].addr, addr)) {
+            slot = i;
+            break;
+        }
+    }
+    k_spin_unlock(&profiles_lock, key);
+
+    return slot;
+}
+
+/* Free slot, or the least recently used one whose keyboard is not connected */
+static uint8_t profiles_victim(void)
+{
+    uint8_t victim = PROFILE_NONE;
+
+    for (uint8_t i = 0; i < ARRAY_SIZE(profiles); i++) {
+        const struct profile *prof = &profiles[i];
+
+        if (!profile_used(prof)) {
+            return i;
+        }
+        if (profile_connected(prof)) {
+            continue;
+        }
+        if (victim == PROFILE_NONE || prof->last_used < profiles[victim].last_used) {
+            victim = i;
+        }
+    }
+
+    return victim;
+}
+
+uint8_t profiles_use(const bt_addr_le_t *addr)
+{
+    uint8_t slot = profiles_find(addr);
+    k_spinlock_key_t key;
+
+    if (slot == PROFILE_NONE) {
+        slot = profiles_victim();
+        if (slot == PROFILE_NONE) {
+            LOG_WRN("Every stored keyboard is connected, not storing another");
+            return PROFILE_NONE;
+        }
+        if (profile_used(&profiles[slot])) {
+            char str[BT_ADDR_LE_STR_LEN];
+
+            bt_addr_le_to_str(&profiles[slot].addr, str, sizeof(str));
+            LOG_INF("Profile table full, evicting %s", str);
+            profiles_forget(slot);
+        }
+
+        key = k_spin_lock(&profiles_lock);
+        bt_addr_le_copy(&profiles[slot].addr, addr);
+        k_spin_unlock(&profiles_lock, key);
+    }
+
+    key = k_spin_lock(&profiles_lock);
+    profiles[slot].last_used = ++profiles_seq;
+    k_spin_unlock(&profiles_lock, key);
+
+    profile_save(slot);
+    return slot;
+}
+
+void profiles_bonded(uint8_t slot, const bt_addr_le_t *identity)
+{
+    uint8_t other = profiles_find(identity);
+    k_spinlock_key_t key;
+
+    if (slot >= ARRAY_SIZE(profiles)) {
+        return;
+    }
+
+    /* Same keyboard stored before under its identity: keep one slot */
+    if (other != PROFILE_NONE && other != slot) {
+        profile_release(other);
+    }
+
+    key = k_spin_lock(&profiles_lock);
+    bt_addr_le_copy(&profiles[slot].addr, identity);
+    profiles[slot].bonded = true;
+    k_spin_unlock(&profiles_lock, key);
+
+    profile_save(slot);
+}
+
+void profiles_params(uint8_t slot, uint16_t interval, uint16_t latency,
+                     uint16_t timeout)
+{
+    struct profile *prof;
+    k_spinlock_key_t key;
+    bool changed;
+
+    if (slot >= ARRAY_SIZE(profiles)) {
+        return;
+    }
+
+    prof = &profiles[slot];
+    key = k_spin_lock(&profiles_lock);
+    /* Forgotten or evicted since the keyboard connected */
+    if (!profile_used(prof)) {
+        k_spin_unlock(&profiles_lock, key);
+        return;
+    }
+    changed = prof->interval != interval || prof->latency != latency ||
+              prof->timeout != timeout;
+    prof->interval = interval;
+    prof->latency = latency;
+    prof->timeout = timeout;
+    k_spin_unlock(&profiles_lock, key);
+
+    if (changed) {
+        profile_save(slot);
+    }
+}
+
+void profiles_forget(uint8_t slot)
+{
+    struct profile prof;
+
+    if (profiles_get(slot, &prof)) {
+        return;
+    }
+
+    hids_client_forget(&prof.addr);
+    if (prof.bonded) {
+        bt_unpair(BT_ID_DEFAULT, &prof.addr);
+    }
+    profile_release(slot);
+}
+
+void profiles_clear(void)
+{
+    for (uint8_t i = 0; i < ARRAY_SIZE(profiles); i++) {
+        profiles_forget(i);
+    }
+}
+
+uint8_t profiles_next(uint8_t slot)
+{
+    /* From PROFILE_NONE, the first stored slot */
+    uint8_t start = (slot < ARRAY_SIZE(profiles)) ? slot : ARRAY_SIZE(profiles) - 1;
+    k_spinlock_key_t key = k_spin_lock(&profiles_lock);
+    uint8_t next = PROFILE_NONE;
+
+    for (uint8_t i = 1; i <= ARRAY_SIZE(profiles); i++) {
+        uint8_t candidate = (start + i) % ARRAY_SIZE(profiles);
+
+        if (candidate != slot && profile_used(&profiles[candidate])) {
+            next = candidate;
+            break;
+        }
+    }
+    k_spin_unlock(&profiles_lock, key);
+
+    return next;
+}
+
+#if IS_ENABLED(CONFIG_BRIDGE_PROFILE_SHELL)
+static int cmd_profiles(const struct shell *sh, size_t argc, char **argv)
+{
+    for (uint8_t i = 0; i < ARRAY_SIZE(profiles); i++) {
+        char str[BT_ADDR_LE_STR_LEN];
+        struct profile prof;
+
+        if (profiles_get(i, &prof)) {
+            shell_print(sh, "%u: -", i);
+            continue;
+        }
+
+        bt_addr_le_to_str(&prof.addr, str, sizeof(str));
+        shell_print(sh, "%u: %s%s%s, used %u, interval %u latency %u timeout %u",
+                    i, str, prof.bonded ? " bonded" : "",
+                    profile_connected(&prof) ? " connected" : "",
+                    prof.last_used, prof.interval, prof.latency, prof.timeout);
+    }
+
+    return 0;
+}
+
+static int cmd_storage(const struct shell *sh, size_t argc, char **argv)
+{
+    struct persist_stats stats;
+
+    persist_stats_get(&stats);
+    shell_print(sh, "requests %u, coalesced %u, unchanged %u, direct %u",
+                stats.requests, stats.coalesced, stats.unchanged, stats.direct);
+    shell_print(sh, "writes %u, deletes %u, failures %u",
+                stats.writes, stats.deletes, stats.failures);
+    shell_print(sh, "free %d bytes, %u sectors of %u bytes",
+                stats.free_bytes, stats.sector_count, stats.sector_size);
+
+    return 0;
+}
+
+static int cmd_link(const struct shell *sh, size_t argc, char **argv)
+{
+    struct ble_link_stats stats;
+    struct ble_link_radio radio;
+
+    ble_link_get_stats(&stats);
+    shell_print(sh, "fast %llu ms, idle %llu ms, %u switches (%u deferred)",
+                (unsigned long long)stats.time_ms[BLE_LINK_FAST],
+                (unsigned long long)stats.time_ms[BLE_LINK_IDLE],
+                stats.switches, stats.deferred);
+
+    ble_link_get_radio(&radio);
+    if (!radio.tx_phy) {
+        shell_print(sh, "no link");
+        return 0;
+    }
+    shell_print(sh, "PHY TX %u RX %u, data length TX %u octets/%u us, RX %u octets/%u us",
+                radio.tx_phy, radio.rx_phy, radio.tx_max_len, radio.tx_max_time,
+                radio.rx_max_len, radio.rx_max_time);
+
+    return 0;
+}
+
+static int cmd_slot(const struct shell *sh, const char *arg, uint8_t *slot)
+{
+    char *end;
+    unsigned long value = strtoul(arg, &end, 10);
+    struct profile prof;
+
+    if (end == arg || *end || value >= ARRAY_SIZE(profiles) ||
+        profiles_get((uint8_t)value, &prof)) {
+        shell_error(sh, "No keyboard in slot %s", arg);
+        return -ENOENT;
+    }
+
+    *slot = (uint8_t)value;
+    return 0;
+}
+
+static int cmd_switch(const struct shell *sh, size_t argc, char **argv)
+{
+    uint8_t slot;
+    int err = cmd_slot(sh, argv[1], &slot);
+
+    if (!err) {
+        conn_mgr_switch(slot);
+    }
+    return err;
+}
+
+static int cmd_forget(const struct shell *sh, size_t argc, char **argv)
+{
+    uint8_t slot;
+    int err = cmd_slot(sh, argv[1], &slot);
+
+    if (!err) {
+        conn_mgr_forget_profile(slot);
+    }
+    return err;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(bridge_cmds,
+    SHELL_CMD(profiles, NULL, "List stored keyboards", cmd_profiles),
+    SHELL_CMD_ARG(switch, NULL, "Connect to a stored keyboard: switch <slot>",
+                  cmd_switch, 2, 0),
+    SHELL_CMD_ARG(forget, NULL, "Drop a stored keyboard: forget <slot>",
+                  cmd_forget, 2, 0),
+    SHELL_CMD(storage, NULL, "Settings write counters and flash use", cmd_storage),
+    SHELL_CMD(link, NULL, "Time per parameter set, PHY and data length", cmd_link),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(bridge, &bridge_cmds, "Kinesis bridge", NULL);
+#endif
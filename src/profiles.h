@@ -0,0 +1,71 @@
+/*
+ * Keyboard profile table
+ *
+ * A fixed table of CONFIG_BRIDGE_PROFILE_SLOTS stored keyboards, one
+ * settings entry per slot under ble_bridge/prof. A slot holds the
+ * keyboard's identity address, whether it is bonded, the connection
+ * parameters it granted last time and when it was last used; its GATT
+ * handles are the hids_client cache entry for the same address, dropped
+ * with the slot. Connecting to a new keyboard with the table full evicts
+ * the least recently used one that is not connected, bond included.
+ *
+ * The table is changed on the system workqueue only.
+ */
+
+#ifndef PROFILES_H_
+#define PROFILES_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <zephyr/bluetooth/bluetooth.h>
+
+#define PROFILE_NONE 0xFF
+
+struct profile {
+    bt_addr_le_t addr;      /* Identity address once bonded */
+    uint32_t last_used;     /* Use count at the last connection, 0 for a free slot */
+    uint16_t interval;      /* Parameters granted last time, 1.25 ms units; 0 if unknown */
+    uint16_t latency;
+    uint16_t timeout;       /* 10 ms units */
+    bool bonded;
+};
+
+/* Read the table from settings, taking over the old ble_bridge/addr entry */
+void profiles_load(void);
+
+/* Slots in use */
+uint8_t profiles_count(void);
+
+/* Copy of a slot; -ENOENT if it is free */
+int profiles_get(uint8_t slot, struct profile *profile);
+
+/* Slot of a keyboard, PROFILE_NONE if it is not stored */
+uint8_t profiles_find(const bt_addr_le_t *addr);
+
+/*
+ * Keyboard connected: refresh its slot, or take a free one or the least
+ * recently used one. Returns the slot, PROFILE_NONE if every stored
+ * keyboard is connected.
+ */
+uint8_t profiles_use(const bt_addr_le_t *addr);
+
+/* Pairing done; the identity address replaces the one connected to */
+void profiles_bonded(uint8_t slot, const bt_addr_le_t *identity);
+
+/* Connection parameters the keyboard settled on, saved if they changed */
+void profiles_params(uint8_t slot, uint16_t interval, uint16_t latency,
+                     uint16_t timeout);
+
+/* Drop a slot with its bond and GATT handles */
+void profiles_forget(uint8_t slot);
+
+/* Drop every slot */
+void profiles_clear(void);
+
+/*
+ * Next stored slot after slot, wrapping around; the first one for
+ * PROFILE_NONE. PROFILE_NONE if there is no other.
+ */
+uint8_t profiles_next(uint8_t slot);
+
+#endif /* PROFILES_H_ */
@@ -0,0 +1,758 @@
+/*
+ * HID Report Map compiler
+ *
+ * Walks the short items of a HID report descriptor once and records every
+ * data field with its bit offset, size and usage range. Global state
+ * (including Push/Pop) and local usages are tracked as the HID spec
+ * describes; long items are skipped. A variable main item with a list of
+ * separate usages is split into one field per run of consecutive usages.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+
+#include "report_map.h"
+
+LOG_MODULE_DECLARE(ble_bridge, LOG_LEVEL_INF);
+
+/* Item types */
+#define ITEM_MAIN           0x0
+#define ITEM_GLOBAL         0x1
+#define ITEM_LOCAL          0x2
+#define ITEM_LONG_PREFIX    0xFE
+
+/* Main item tags */
+#define MAIN_INPUT          0x8
+#define MAIN_OUTPUT         0x9
+#define MAIN_COLLECTION     0xA
+#define MAIN_FEATURE        0xB
+#define MAIN_END_COLLECTION 0xC
+
+/* Global item tags */
+#define GLOBAL_USAGE_PAGE   0x0
+#define GLOBAL_LOGICAL_MIN  0x1
+#define GLOBAL_LOGICAL_MAX  0x2
+#define GLOBAL_REPORT_SIZE  0x7
+#define GLOBAL_REPORT_ID    0x8
+#define GLOBAL_REPORT_COUNT 0x9
+#define GLOBAL_PUSH         0xA
+#define GLOBAL_POP          0xB
+
+/* Local item tags */
+#define LOCAL_USAGE         0x0
+#define LOCAL_USAGE_MIN     0x1
+#define LOCAL_USAGE_MAX     0x2
+
+/* Main item data bits */
+#define MAIN_FLAG_CONSTANT  BIT(0)
+#define MAIN_FLAG_VARIABLE  BIT(1)
+#define MAIN_FLAG_RELATIVE  BIT(2)
+
+#define COLLECTION_APPLICATION 0x01
+
+#define GLOBAL_STACK_DEPTH  4
+#define LOCAL_USAGE_RANGES  8
+
+struct global_state {
+    uint16_t usage_page;
+    int32_t logical_min;
+    uint32_t logical_max_raw;
+    int32_t logical_max_signed;
+    uint8_t report_size;
+    uint8_t report_id;
+    uint16_t report_count;
+};
+
+struct usage_range {
+    uint32_t min;
+    uint32_t max;
+};
+
+/*
+ * Local usages in descriptor order. A Usage item that follows on from the
+ * previous usage extends its range; Usage Minimum and Maximum give one
+ * range of their own.
+ */
+struct local_state {
+    struct usage_range usages[LOCAL_USAGE_RANGES];
+    uint8_t count;
+    uint8_t open;           /* LOCAL_USAGE_MIN/MAX of a range missing its other end, or 0 */
+};
+
+static int report_map_add_report(struct report_map *map, uint8_t type,
+                                 uint8_t id, uint16_t app_usage_page,
+                                 uint16_t app_usage)
+{
+    for (int i = 0; i < map->report_count; i++) {
+        if (map->reports[i].type == type && map->reports[i].id == id) {
+            return i;
+        }
+    }
+
+    if (map->report_count >= REPORT_MAP_MAX_REPORTS) {
+        return -ENOMEM;
+    }
+
+    struct report_info *rep = &map->reports[map->report_count];
+
+    memset(rep, 0, sizeof(*rep));
+    rep->type = type;
+    rep->id = id;
+    rep->app_usage_page = app_usage_page;
+    rep->app_usage = app_usage;
+
+    return map->report_count++;
+}
+
+/* Resolve a 32-bit extended usage against the current Usage Page */
+static uint16_t usage_page_of(uint32_t usage, const struct global_state *g)
+{
+    return (usage > 0xFFFF) ? (uint16_t)(usage >> 16) : g->usage_page;
+}
+
+static int local_add_usage(struct local_state *l, uint8_t tag, uint32_t usage)
+{
+    struct usage_range *last = l->count ? &l->usages[l->count - 1] : NULL;
+
+    /* Other end of a Usage Minimum/Maximum pair */
+    if (l->open && tag != LOCAL_USAGE && tag != l->open) {
+        if (tag == LOCAL_USAGE_MIN) {
+            last->min = usage;
+        } else {
+            last->max = usage;
+        }
+        l->open = 0;
+        return 0;
+    }
+
+    if (tag == LOCAL_USAGE && !l->open && last && last->max + 1 == usage) {
+        last->max = usage;
+        return 0;
+    }
+
+    if (l->count >= LOCAL_USAGE_RANGES) {
+        return -ENOMEM;
+    }
+
+    l->usages[l->count++] = (struct usage_range){ usage, usage };
+    l->open = (tag == LOCAL_USAGE) ? 0 : tag;
+    return 0;
+}
+
+static int report_map_add_field(struct report_map *map, uint8_t *owner,
+                                uint8_t r, uint16_t bit_offset, uint16_t count,
+                                uint8_t flags, const struct usage_range *usage,
+                                const struct global_state *g)
+{
+    if (map->field_count >= REPORT_MAP_MAX_FIELDS) {
+        return -ENOMEM;
+    }
+
+    struct report_field *f = &map->fields[map->field_count];
+
+    f->bit_offset = bit_offset;
+    f->bit_size = g->report_size;
+    f->count = count;
+    f->flags = flags;
+    f->usage_page = usage_page_of(usage->min, g);
+    f->usage_min = (uint16_t)usage->min;
+    f->usage_max = (uint16_t)usage->max;
+    f->logical_min = g->logical_min;
+    f->logical_max = (g->logical_min >= 0) ?
+                     (int32_t)g->logical_max_raw : g->logical_max_signed;
+    owner[map->field_count++] = r;
+    return 0;
+}
+
+/*
+ * Fields are recorded in descriptor order; group them by report afterwards
+ * so each report owns one contiguous run of the field table.
+ */
+static void report_map_group_fields(struct report_map *map,
+                                    const uint8_t owner[REPORT_MAP_MAX_FIELDS])
+{
+    struct report_field sorted[REPORT_MAP_MAX_FIELDS];
+    uint8_t n = 0;
+
+    for (uint8_t r = 0; r < map->report_count; r++) {
+        map->reports[r].first_field = n;
+        map->reports[r].field_count = 0;
+
+        for (uint8_t f = 0; f < map->field_count; f++) {
+            if (owner[f] == r) {
+                sorted[n++] = map->fields[f];
+                map->reports[r].field_count++;
+            }
+        }
+    }
+
+    memcpy(map->fields, sorted, n * sizeof(sorted[0]));
+}
+
+int report_map_parse(struct report_map *map, const uint8_t *desc, size_t len)
+{
+    struct global_state g = {0};
+    struct global_state stack[GLOBAL_STACK_DEPTH];
+    struct local_state l = {0};
+    uint8_t owner[REPORT_MAP_MAX_FIELDS];
+    uint8_t sp = 0;
+    uint8_t depth = 0;
+    uint16_t app_usage_page = 0;
+    uint16_t app_usage = 0;
+    size_t i = 0;
+
+    memset(map, 0, sizeof(*map));
+
+    while (i < len) {
+        uint8_t prefix = desc[i++];
+
+        if (prefix == ITEM_LONG_PREFIX) {
+            if (i + 2 > len) {
+                return -EINVAL;
+            }
+            i += 2 + desc[i];
+            continue;
+        }
+
+        uint8_t size = prefix & 0x03;
+        uint8_t type = (prefix >> 2) & 0x03;
+        uint8_t tag = prefix >> 4;
+
+        if (size == 3) {
+            size = 4;
+        }
+        if (i + size > len) {
+            return -EINVAL;
+        }
+
+        uint32_t uval = 0;
+        for (uint8_t k = 0; k < size; k++) {
+            uval |= (uint32_t)desc[i + k] << (8 * k);
+        }
+        int32_t sval = (int32_t)uval;
+        if (size == 1) {
+            sval = (int8_t)uval;
+        } else if (size == 2) {
+            sval = (int16_t)uval;
+        }
+        i += size;
+
+        switch (type) {
+        case ITEM_MAIN:
+            if (tag == MAIN_INPUT || tag == MAIN_OUTPUT || tag == MAIN_FEATURE) {
+                uint8_t rtype = (tag == MAIN_INPUT) ? REPORT_TYPE_INPUT :
+                                (tag == MAIN_OUTPUT) ? REPORT_TYPE_OUTPUT :
+                                REPORT_TYPE_FEATURE;
+                int r = report_map_add_report(map, rtype, g.report_id,
+                                              app_usage_page, app_usage);
+                if (r < 0) {
+                    return r;
+                }
+
+                struct report_info *rep = &map->reports[r];
+                uint32_t bits = (uint32_t)g.report_size * g.report_count;
+
+                if (!(uval & MAIN_FLAG_CONSTANT) && l.count && bits > 0) {
+                    uint8_t flags = ((uval & MAIN_FLAG_VARIABLE) ? REPORT_FIELD_VARIABLE : 0) |
+                                    ((uval & MAIN_FLAG_RELATIVE) ? REPORT_FIELD_RELATIVE : 0);
+                    int err = 0;
+
+                    /* Values are read into 32 bits; anything wider is not a field we can use */
+                    if (g.report_size == 0 || g.report_size > 32) {
+                        return -EINVAL;
+                    }
+
+                    if (uval & MAIN_FLAG_VARIABLE) {
+                        /* Usages go to the values in order, the last one repeating (HID 1.11 6.2.2.8) */
+                        uint16_t done = 0;
+
+                        for (uint8_t k = 0; k < l.count && done < g.report_count && !err; k++) {
+                            const struct usage_range *u = &l.usages[k];
+                            uint32_t span = (u->max >= u->min) ? u->max - u->min + 1 : 1;
+                            uint16_t n = g.report_count - done;
+
+                            if (k + 1 < l.count) {
+                                n = MIN(n, span);
+                            }
+                            err = report_map_add_field(map, owner, (uint8_t)r,
+                                                       rep->bit_len + done * g.report_size,
+                                                       n, flags, u, &g);
+                            done += n;
+                        }
+                    } else {
+                        /* Array: its values index one range */
+                        struct usage_range all = {
+                            l.usages[0].min, l.usages[l.count - 1].max,
+                        };
+
+                        err = report_map_add_field(map, owner, (uint8_t)r, rep->bit_len,
+                                                   g.report_count, flags, &all, &g);
+                    }
+                    if (err) {
+                        return err;
+                    }
+                }
+
+                if (rep->bit_len + bits > UINT16_MAX) {
+                    return -EINVAL;
+                }
+                rep->bit_len += bits;
+            } else if (tag == MAIN_COLLECTION) {
+                if (depth == 0 && uval == COLLECTION_APPLICATION) {
+                    app_usage_page = usage_page_of(l.usages[0].min, &g);
+                    app_usage = (uint16_t)l.usages[0].min;
+                }
+                depth++;
+            } else if (tag == MAIN_END_COLLECTION) {
+                if (depth == 0) {
+                    return -EINVAL;
+                }
+                depth--;
+            }
+            memset(&l, 0, sizeof(l));
+            break;
+
+        case ITEM_GLOBAL:
+            switch (tag) {
+            case GLOBAL_USAGE_PAGE:
+                g.usage_page = (uint16_t)uval;
+                break;
+            case GLOBAL_LOGICAL_MIN:
+                g.logical_min = sval;
+                break;
+            case GLOBAL_LOGICAL_MAX:
+                g.logical_max_raw = uval;
+                g.logical_max_signed = sval;
+                break;
+            case GLOBAL_REPORT_SIZE:
+                if (uval == 0 || uval > 32) {
+                    return -EINVAL;
+                }
+                g.report_size = (uint8_t)uval;
+                break;
+            case GLOBAL_REPORT_ID:
+                if (uval == 0 || uval > UINT8_MAX) {
+                    return -EINVAL;
+                }
+                g.report_id = (uint8_t)uval;
+                map->report_ids = true;
+                break;
+            case GLOBAL_REPORT_COUNT:
+                g.report_count = (uint16_t)uval;
+                break;
+            case GLOBAL_PUSH:
+                if (sp >= GLOBAL_STACK_DEPTH) {
+                    return -ENOMEM;
+                }
+                stack[sp++] = g;
+                break;
+            case GLOBAL_POP:
+                if (sp == 0) {
+                    return -EINVAL;
+                }
+                g = stack[--sp];
+                break;
+            default:
+                /* Physical range and units do not affect the layout */
+                break;
+            }
+            break;
+
+        case ITEM_LOCAL:
+            if (tag == LOCAL_USAGE || tag == LOCAL_USAGE_MIN || tag == LOCAL_USAGE_MAX) {
+                int err = local_add_usage(&l, tag, uval);
+
+                if (err) {
+                    return err;
+                }
+            }
+            break;
+
+        default:
+            return -EINVAL;
+        }
+    }
+
+    report_map_group_fields(map, owner);
+
+    LOG_INF("Report Map: %u reports, %u fields", map->report_count,
+            map->field_count);
+    return 0;
+}
+
+const struct report_info *report_map_find(const struct report_map *map,
+                                          uint8_t type, uint8_t id)
+{
+    for (uint8_t i = 0; i < map->report_count; i++) {
+        if (map->reports[i].type == type && map->reports[i].id == id) {
+            return &map->reports[i];
+        }
+    }
+
+    return NULL;
+}
+
+uint32_t report_field_get(const uint8_t *data, uint16_t len,
+                          uint16_t bit_offset, uint8_t bit_size)
+{
+    uint32_t value = 0;
+    uint8_t bit = 0;
+
+    bit_size = MIN(bit_size, 32);
+    while (bit < bit_size) {
+        uint32_t pos = (uint32_t)bit_offset + bit;
+        uint32_t byte = pos >> 3;
+
+        if (byte >= len) {
+            break;
+        }
+
+        uint8_t shift = pos & 0x07;
+        uint8_t take = MIN(8 - shift, bit_size - bit);
+
+        value |= ((uint32_t)(data[byte] >> shift) & (BIT(take) - 1U)) << bit;
+        bit += take;
+    }
+
+    return value;
+}
+
+void report_field_set(uint8_t *data, uint16_t len, uint16_t bit_offset,
+                      uint8_t bit_size, uint32_t value)
+{
+    uint8_t bit = 0;
+
+    bit_size = MIN(bit_size, 32);
+    while (bit < bit_size) {
+        uint32_t pos = (uint32_t)bit_offset + bit;
+        uint32_t byte = pos >> 3;
+
+        if (byte >= len) {
+            break;
+        }
+
+        uint8_t shift = pos & 0x07;
+        uint8_t take = MIN(8 - shift, bit_size - bit);
+        uint8_t mask = (uint8_t)((BIT(take) - 1U) << shift);
+
+        data[byte] = (data[byte] & ~mask) | (uint8_t)(((value >> bit) << shift) & mask);
+        bit += take;
+    }
+}
+
+/* Report every active usage of one bitmap field */
+static void report_field_for_each_bit(const struct report_field *f,
+                                      const uint8_t *data, uint16_t len,
+                                      report_usage_cb_t cb, void *user_data)
+{
+    uint16_t count = MIN(f->count, (uint16_t)(f->usage_max - f->usage_min + 1));
+
+    for (uint16_t idx = 0; idx < count; idx++) {
+        uint32_t pos = f->bit_offset + idx;
+
+        /* Skip a whole empty byte at a time - NKRO bitmaps are mostly zero */
+        if ((pos & 0x07) == 0 && idx + 8 <= count &&
+            (pos >> 3) < len && data[pos >> 3] == 0) {
+            idx += 7;
+            continue;
+        }
+
+        if (report_field_get(data, len, pos, 1)) {
+            cb(f->usage_min + idx, user_data);
+        }
+    }
+}
+
+void report_map_for_each_usage(const struct report_map *map,
+                               const struct report_info *rep,
+                               const uint8_t *data, uint16_t len,
+                               uint16_t usage_page,
+                               report_usage_cb_t cb, void *user_data)
+{
+    for (uint8_t i = 0; i < rep->field_count; i++) {
+        const struct report_field *f = &map->fields[rep->first_field + i];
+
+        if (f->usage_page != usage_page) {
+            continue;
+        }
+
+        if ((f->flags & REPORT_FIELD_VARIABLE) && f->bit_size == 1) {
+            report_field_for_each_bit(f, data, len, cb, user_data);
+            continue;
+        }
+
+        for (uint16_t idx = 0; idx < f->count; idx++) {
+            uint32_t raw = report_field_get(data, len,
+                                            f->bit_offset + idx * f->bit_size,
+                                            f->bit_size);
+
+            if (f->flags & REPORT_FIELD_VARIABLE) {
+                /* Values past the range repeat its last usage */
+                if (raw && f->usage_min + idx <= f->usage_max) {
+                    cb(f->usage_min + idx, user_data);
+                }
+                continue;
+            }
+
+            /* Array: out-of-range values mean "no usage" */
+            int32_t value = (int32_t)raw;
+            if (value < f->logical_min || value > f->logical_max) {
+                continue;
+            }
+
+            uint32_t usage = f->usage_min + (uint32_t)(value - f->logical_min);
+            if (usage != 0 && usage <= f->usage_max) {
+                cb((uint16_t)usage, user_data);
+            }
+        }
+    }
+}
+
+bool report_map_get_value(const struct report_map *map,
+                          const struct report_info *rep,
+                          const uint8_t *data, uint16_t len,
+                          uint16_t usage_page, uint16_t usage, int32_t *value)
+{
+    for (uint8_t i = 0; i < rep->field_count; i++) {
+        const struct report_field *f = &map->fields[rep->first_field + i];
+        uint16_t idx = usage - f->usage_min;
+
+        if (!(f->flags & REPORT_FIELD_VARIABLE) || f->usage_page != usage_page ||
+            usage < f->usage_min || usage > f->usage_max || idx >= f->count) {
+            continue;
+        }
+
+        uint32_t raw = report_field_get(data, len, f->bit_offset + idx * f->bit_size,
+                                        f->bit_size);
+
+        /* Sign-extend fields with a negative logical range */
+        if (f->logical_min < 0 && f->bit_size > 0 && f->bit_size < 32 &&
+            (raw & BIT(f->bit_size - 1))) {
+            raw |= ~(uint32_t)(BIT(f->bit_size) - 1U);
+        }
+
+        *value = (int32_t)raw;
+        return true;
+    }
+
+    return false;
+}
+
+bool report_map_set_usage(const struct report_map *map,
+                          const struct report_info *rep,
+                          uint8_t *data, uint16_t len,
+                          uint16_t usage_page, uint16_t usage)
+{
+    for (uint8_t i = 0; i < rep->field_count; i++) {
+        const struct report_field *f = &map->fields[rep->first_field + i];
+
+        if (f->usage_page != usage_page ||
+            usage < f->usage_min || usage > f->usage_max) {
+            continue;
+        }
+
+        if (f->flags & REPORT_FIELD_VARIABLE) {
+            uint16_t idx = usage - f->usage_min;
+
+            if (idx < f->count) {
+                report_field_set(data, len, f->bit_offset + idx * f->bit_size,
+                                 f->bit_size, 1);
+                return true;
+            }
+            continue;
+        }
+
+        /* Array: first empty slot */
+        int32_t value = f->logical_min + (int32_t)(usage - f->usage_min);
+
+        if (value > f->logical_max) {
+            continue;
+        }
+
+        for (uint16_t idx = 0; idx < f->count; idx++) {
+            uint16_t pos = f->bit_offset + idx * f->bit_size;
+
+            if (report_field_get(data, len, pos, f->bit_size) == 0) {
+                report_field_set(data, len, pos, f->bit_size, (uint32_t)value);
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+struct usage_collector {
+    uint16_t *usages;
+    uint8_t count;
+    uint8_t max;
+};
+
+static void collect_usage(uint16_t usage, void *user_data)
+{
+    struct usage_collector *c = user_data;
+
+    if (c->count < c->max) {
+        c->usages[c->count++] = usage;
+    }
+}
+
+uint8_t report_map_collect_usages(const struct report_map *map,
+                                  const struct report_info *rep,
+                                  const uint8_t *data, uint16_t len,
+                                  uint16_t usage_page,
+                                  uint16_t *usages, uint8_t max)
+{
+    struct usage_collector c = { .usages = usages, .max = max };
+
+    report_map_for_each_usage(map, rep, data, len, usage_page,
+                              collect_usage, &c);
+    return c.count;
+}
+
+bool report_map_layout_matches(const struct report_map *map,
+                               const struct report_info *rep,
+                               const struct report_field *layout,
+                               uint8_t count)
+{
+    if (rep->field_count != count) {
+        return false;
+    }
+
+    for (uint8_t i = 0; i < count; i++) {
+        const struct report_field *f = &map->fields[rep->first_field + i];
+        const struct report_field *l = &layout[i];
+
+        if (f->bit_offset != l->bit_offset || f->bit_size != l->bit_size ||
+            f->count != l->count || f->flags != l->flags ||
+            f->usage_page != l->usage_page || f->usage_min != l->usage_min ||
+            f->usage_max != l->usage_max || f->logical_min != l->logical_min ||
+            f->logical_max != l->logical_max) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int report_map_pack(const struct report_map *map, uint8_t *buf, size_t size)
+{
+    size_t len = 3 + map->report_count * REPORT_MAP_PACKED_REPORT +
+                 map->field_count * REPORT_MAP_PACKED_FIELD;
+    uint8_t *p = buf;
+
+    if (len > size) {
+        return -ENOMEM;
+    }
+
+    *p++ = REPORT_MAP_PACKED_VERSION;
+    *p++ = map->report_count;
+    *p++ = map->field_count;
+
+    for (uint8_t i = 0; i < map->report_count; i++) {
+        const struct report_info *rep = &map->reports[i];
+
+        *p++ = rep->id;
+        *p++ = rep->type;
+        sys_put_le16(rep->bit_len, p);
+        sys_put_le16(rep->app_usage_page, p + 2);
+        sys_put_le16(rep->app_usage, p + 4);
+        p[6] = rep->first_field;
+        p[7] = rep->field_count;
+        p += REPORT_MAP_PACKED_REPORT - 2;
+    }
+
+    for (uint8_t i = 0; i < map->field_count; i++) {
+        const struct report_field *f = &map->fields[i];
+
+        sys_put_le16(f->bit_offset, p);
+        p[2] = f->bit_size;
+        p[3] = f->flags;
+        sys_put_le16(f->count, p + 4);
+        sys_put_le16(f->usage_page, p + 6);
+        sys_put_le16(f->usage_min, p + 8);
+        sys_put_le16(f->usage_max, p + 10);
+        sys_put_le32((uint32_t)f->logical_min, p + 12);
+        sys_put_le32((uint32_t)f->logical_max, p + 16);
+        p += REPORT_MAP_PACKED_FIELD;
+    }
+
+    return (int)len;
+}
+
+int report_map_unpack(struct report_map *map, const uint8_t *buf, size_t len)
+{
+    const uint8_t *p = buf + 3;
+
+    if (len < 3 || buf[0] != REPORT_MAP_PACKED_VERSION ||
+        buf[1] > REPORT_MAP_MAX_REPORTS || buf[2] > REPORT_MAP_MAX_FIELDS ||
+        len != 3 + buf[1] * REPORT_MAP_PACKED_REPORT + buf[2] * REPORT_MAP_PACKED_FIELD) {
+        return -EINVAL;
+    }
+
+    memset(map, 0, sizeof(*map));
+    map->report_count = buf[1];
+    map->field_count = buf[2];
+
+    for (uint8_t i = 0; i < map->report_count; i++) {
+        struct report_info *rep = &map->reports[i];
+
+        rep->id = p[0];
+        rep->type = p[1];
+        rep->bit_len = sys_get_le16(p + 2);
+        rep->app_usage_page = sys_get_le16(p + 4);
+        rep->app_usage = sys_get_le16(p + 6);
+        rep->first_field = p[8];
+        rep->field_count = p[9];
+        p += REPORT_MAP_PACKED_REPORT;
+
+        /* With one Report ID in the descriptor, every report has one */
+        if (rep->id) {
+            map->report_ids = true;
+        }
+
+        /* Every lookup indexes the field table through these */
+        if (rep->type < REPORT_TYPE_INPUT || rep->type > REPORT_TYPE_FEATURE ||
+            rep->first_field + rep->field_count > map->field_count) {
+            return -EINVAL;
+        }
+    }
+
+    for (uint8_t i = 0; i < map->field_count; i++) {
+        struct report_field *f = &map->fields[i];
+
+        f->bit_offset = sys_get_le16(p);
+        f->bit_size = p[2];
+        f->flags = p[3];
+        f->count = sys_get_le16(p + 4);
+        f->usage_page = sys_get_le16(p + 6);
+        f->usage_min = sys_get_le16(p + 8);
+        f->usage_max = sys_get_le16(p + 10);
+        f->logical_min = (int32_t)sys_get_le32(p + 12);
+        f->logical_max = (int32_t)sys_get_le32(p + 16);
+        p += REPORT_MAP_PACKED_FIELD;
+
+        /* The parser's own limits: a 1 to 32-bit value, at least one of them */
+        if (!f->bit_size || f->bit_size > 32 || !f->count) {
+            return -EINVAL;
+        }
+    }
+
+    /* Every field inside the payload of its report */
+    for (uint8_t i = 0; i < map->report_count; i++) {
+        const struct report_info *rep = &map->reports[i];
+
+        for (uint8_t j = 0; j < rep->field_count; j++) {
+            const struct report_field *f = &map->fields[rep->first_field + j];
+
+            if ((uint32_t)f->bit_offset + (uint32_t)f->count * f->bit_size > rep->bit_len) {
+                return -EINVAL;
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * HID Report Map compiler
+ *
+ * Parses the keyboard's HID Report Map (HIDS characteristic 0x2A4B) once
+ * into a compact per-report-ID field table. Notifications are then
+ * translated by table lookup instead of by guessing their layout.
+ */
+
+#ifndef REPORT_MAP_H_
+#define REPORT_MAP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* HIDS limits the Report Map value to 512 bytes */
+#define REPORT_MAP_MAX_SIZE     512
+#define REPORT_MAP_MAX_REPORTS  8
+#define REPORT_MAP_MAX_FIELDS   24
+
+/* Report types, numbered as in the HIDS Report Reference descriptor */
+#define REPORT_TYPE_INPUT       0x01
+#define REPORT_TYPE_OUTPUT      0x02
+#define REPORT_TYPE_FEATURE     0x03
+
+/* Usage pages and usages the bridge cares about */
+#define USAGE_PAGE_GENERIC_DESKTOP  0x01
+#define USAGE_PAGE_KEYBOARD         0x07
+#define USAGE_PAGE_LED              0x08
+#define USAGE_PAGE_BUTTON           0x09
+#define USAGE_PAGE_CONSUMER         0x0C
+
+#define USAGE_GD_POINTER            0x01
+#define USAGE_GD_MOUSE              0x02
+#define USAGE_GD_KEYBOARD           0x06
+#define USAGE_GD_X                  0x30
+#define USAGE_GD_Y                  0x31
+#define USAGE_GD_WHEEL              0x38
+#define USAGE_GD_SYSTEM_CONTROL     0x80
+#define USAGE_GD_SYSTEM_POWER_DOWN  0x81
+#define USAGE_GD_SYSTEM_WAKE_UP     0x83
+#define USAGE_CONSUMER_CONTROL      0x01
+#define USAGE_CONSUMER_AC_PAN       0x238
+#define USAGE_LED_NUM_LOCK          0x01
+#define USAGE_LED_KANA              0x05
+
+/* report_field.flags */
+#define REPORT_FIELD_VARIABLE   0x01  /* One value per usage (bitmap) rather than an array */
+#define REPORT_FIELD_RELATIVE   0x02
+
+/* One Input/Output/Feature main item with data (constant padding is skipped) */
+struct report_field {
+    uint16_t bit_offset;    /* From the start of the payload, report ID excluded */
+    uint8_t bit_size;       /* Report Size */
+    uint8_t flags;
+    uint16_t count;         /* Report Count */
+    uint16_t usage_page;
+    uint16_t usage_min;
+    uint16_t usage_max;
+    int32_t logical_min;
+    int32_t logical_max;
+};
+
+struct report_info {
+    uint8_t id;             /* 0 if the map does not use report IDs */
+    uint8_t type;           /* REPORT_TYPE_* */
+    uint16_t bit_len;       /* Payload length in bits, report ID excluded */
+    uint16_t app_usage_page;/* Enclosing application collection */
+    uint16_t app_usage;
+    uint8_t first_field;    /* Index into report_map.fields */
+    uint8_t field_count;
+};
+
+struct report_map {
+    uint8_t report_count;
+    uint8_t field_count;
+    bool report_ids;        /* Every report starts with its ID */
+    struct report_info reports[REPORT_MAP_MAX_REPORTS];
+    struct report_field fields[REPORT_MAP_MAX_FIELDS];
+};
+
+/*
+ * Compile a HID report descriptor into the field table.
+ * Returns 0 on success, -EINVAL for a malformed descriptor or -ENOMEM if it
+ * describes more reports or fields than the table can hold.
+ */
+int report_map_parse(struct report_map *map, const uint8_t *desc, size_t len);
+
+/* Look up a report by type and ID */
+const struct report_info *report_map_find(const struct report_map *map,
+                                          uint8_t type, uint8_t id);
+
+/* Payload size of a report in bytes, report ID excluded */
+static inline uint16_t report_info_size(const struct report_info *rep)
+{
+    return (rep->bit_len + 7U) / 8U;
+}
+
+/* Extract an unsigned bit field (up to 32 bits, LSB first) from a payload */
+uint32_t report_field_get(const uint8_t *data, uint16_t len,
+                          uint16_t bit_offset, uint8_t bit_size);
+
+/* Store an unsigned bit field (up to 32 bits, LSB first) into a payload */
+void report_field_set(uint8_t *data, uint16_t len, uint16_t bit_offset,
+                      uint8_t bit_size, uint32_t value);
+
+/* Called for every active usage found in a report */
+typedef void (*report_usage_cb_t)(uint16_t usage, void *user_data);
+
+/*
+ * Enumerate the active usages of one usage page in a report: set bits of
+ * bitmap fields and in-range values of array fields. Empty bytes of 1-bit
+ * bitmaps are skipped whole.
+ */
+void report_map_for_each_usage(const struct report_map *map,
+                               const struct report_info *rep,
+                               const uint8_t *data, uint16_t len,
+                               uint16_t usage_page,
+                               report_usage_cb_t cb, void *user_data);
+
+/*
+ * Collect up to max active usages of one usage page into an array.
+ * Returns the number of usages stored.
+ */
+uint8_t report_map_collect_usages(const struct report_map *map,
+                                  const struct report_info *rep,
+                                  const uint8_t *data, uint16_t len,
+                                  uint16_t usage_page,
+                                  uint16_t *usages, uint8_t max);
+
+/*
+ * Read the value of one usage of a variable field, sign-extended when the
+ * logical range is signed (pointer axes, wheels). Returns false if the
+ * report does not carry the usage.
+ */
+bool report_map_get_value(const struct report_map *map,
+                          const struct report_info *rep,
+                          const uint8_t *data, uint16_t len,
+                          uint16_t usage_page, uint16_t usage, int32_t *value);
+
+/*
+ * Mark one usage active in a zero-initialised payload: set its bit in a
+ * bitmap field or put it in the first free slot of an array field.
+ * Returns false if the report has no room for the usage.
+ */
+bool report_map_set_usage(const struct report_map *map,
+                          const struct report_info *rep,
+                          uint8_t *data, uint16_t len,
+                          uint16_t usage_page, uint16_t usage);
+
+/*
+ * True if a report has exactly the given field layout, in which case its
+ * payload can be forwarded byte for byte.
+ */
+bool report_map_layout_matches(const struct report_map *map,
+                               const struct report_info *rep,
+                               const struct report_field *layout,
+                               uint8_t count);
+
+/*
+ * Compiled table in its stored form: a version byte, the report and field
+ * counts, then every report and field little-endian without padding. Bump
+ * REPORT_MAP_PACKED_VERSION whenever that layout or the parser's output
+ * changes, so tables compiled by an older build are compiled again.
+ */
+#define REPORT_MAP_PACKED_VERSION   2
+#define REPORT_MAP_PACKED_REPORT    10
+#define REPORT_MAP_PACKED_FIELD     20
+#define REPORT_MAP_PACKED_MAX_SIZE  (3 + REPORT_MAP_MAX_REPORTS * REPORT_MAP_PACKED_REPORT + \
+                                     REPORT_MAP_MAX_FIELDS * REPORT_MAP_PACKED_FIELD)
+
+/* Serialize a compiled table; returns its length or -ENOMEM if buf is too small */
+int report_map_pack(const struct report_map *map, uint8_t *buf, size_t size);
+
+/*
+ * Load a table stored by report_map_pack(). Returns -EINVAL for another
+ * version or a table that is not self-consistent; map is then unusable.
+ */
+int report_map_unpack(struct report_map *map, const uint8_t *buf, size_t len);
+
+#endif /* REPORT_MAP_H_ */
@@ -0,0 +1,1044 @@
+/*
+ * USB side of the bridge
+ *
+ * Reports flow from the BLE notification handler (producer, BT RX thread)
+ * to the USB IN writers (consumers) through single-producer/single-consumer
+ * rings, one per HID interface. Each USB report also has a current-state
+ * register: when its ring is full the producer merges into the register
+ * instead, and the writer flushes dirty registers once the ring is drained,
+ * so the newest state of every report (in particular a key release) always
+ * reaches the host.
+ *
+ * With CONFIG_BRIDGE_DESCRIPTOR_PASSTHROUGH the keyboard interface can use
+ * the keyboard's own Report Map as its descriptor; its input reports then
+ * get registers of their own and are forwarded untouched.
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/usb/usb_device.h>
+#include <zephyr/usb/class/usb_hid.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+
+#include "usb_bridge.h"
+
+LOG_MODULE_DECLARE(ble_bridge, LOG_LEVEL_INF);
+
+/*
+ * Keyboard interface (HID_0): a single report without an ID, boot-compatible,
+ * or an NKRO bitmap with CONFIG_BRIDGE_USB_NKRO. Either way boot protocol
+ * hosts get the separate boot report.
+ */
+static const uint8_t keyboard_report_desc[] = {
+    0x05, 0x01,     /* Usage Page (Generic Desktop) */
+    0x09, 0x06,     /* Usage (Keyboard) */
+    0xA1, 0x01,     /* Collection (Application) */
+
+    /* Modifier keys byte */
+    0x05, 0x07,     /* Usage Page (Key Codes) */
+    0x19, 0xE0,     /* Usage Minimum (224) */
+    0x29, 0xE7,     /* Usage Maximum (231) */
+    0x15, 0x00,     /* Logical Minimum (0) */
+    0x25, 0x01,     /* Logical Maximum (1) */
+    0x75, 0x01,     /* Report Size (1) */
+    0x95, 0x08,     /* Report Count (8) */
+    0x81, 0x02,     /* Input (Data, Variable, Absolute) */
+
+    /* Reserved byte */
+    0x75, 0x08,     /* Report Size (8) */
+    0x95, 0x01,     /* Report Count (1) */
+    0x81, 0x01,     /* Input (Constant) */
+
+    /* LED output byte */
+    0x05, 0x08,     /* Usage Page (LEDs) */
+    0x19, 0x01,     /* Usage Minimum (Num Lock) */
+    0x29, 0x05,     /* Usage Maximum (Kana) */
+    0x75, 0x01,     /* Report Size (1) */
+    0x95, 0x05,     /* Report Count (5) */
+    0x91, 0x02,     /* Output (Data, Variable, Absolute) */
+    0x75, 0x03,     /* Report Size (3) */
+    0x95, 0x01,     /* Report Count (1) */
+    0x91, 0x01,     /* Output (Constant) */
+
+#if IS_ENABLED(CONFIG_BRIDGE_USB_NKRO)
+    /* Key bitmap, one bit per usage below the modifiers */
+    0x05, 0x07,     /* Usage Page (Key Codes) */
+    0x19, 0x00,     /* Usage Minimum (0) */
+    0x29, NKRO_BITMAP_USAGES - 1, /* Usage Maximum (223) */
+    0x15, 0x00,     /* Logical Minimum (0) */
+    0x25, 0x01,     /* Logical Maximum (1) */
+    0x75, 0x01,     /* Report Size (1) */
+    0x95, NKRO_BITMAP_USAGES, /* Report Count (224) */
+    0x81, 0x02,     /* Input (Data, Variable, Absolute) */
+#else
+    /* Key array (6 keys) */
+    0x05, 0x07,     /* Usage Page (Key Codes) */
+    0x19, 0x00,     /* Usage Minimum (0) */
+    0x29, 0xFF,     /* Usage Maximum (255) */
+    0x15, 0x00,     /* Logical Minimum (0) */
+    0x26, 0xFF, 0x00, /* Logical Maximum (255) */
+    0x75, 0x08,     /* Report Size (8) */
+    0x95, BOOT_REPORT_KEYS, /* Report Count (6) */
+    0x81, 0x00,     /* Input (Data, Array) */
+#endif
+
+    0xC0,           /* End Collection */
+};
+
+/* Consumer interface (HID_1): media keys and system control */
+static const uint8_t consumer_report_desc[] = {
+    /* Consumer Control - same layout as ZMK's full consumer report */
+    0x05, 0x0C,     /* Usage Page (Consumer) */
+    0x09, 0x01,     /* Usage (Consumer Control) */
+    0xA1, 0x01,     /* Collection (Application) */
+    0x85, USB_REPORT_ID_CONSUMER, /* Report ID */
+    0x15, 0x00,     /* Logical Minimum (0) */
+    0x26, 0xFF, 0x0F, /* Logical Maximum (4095) */
+    0x19, 0x00,     /* Usage Minimum (0) */
+    0x2A, 0xFF, 0x0F, /* Usage Maximum (4095) */
+    0x75, 0x10,     /* Report Size (16) */
+    0x95, USB_CONSUMER_REPORT_KEYS, /* Report Count (6) */
+    0x81, 0x00,     /* Input (Data, Array) */
+    0xC0,           /* End Collection */
+
+    /* System Control */
+    0x05, 0x01,     /* Usage Page (Generic Desktop) */
+    0x09, 0x80,     /* Usage (System Control) */
+    0xA1, 0x01,     /* Collection (Application) */
+    0x85, USB_REPORT_ID_SYSTEM, /* Report ID */
+    0x19, 0x81,     /* Usage Minimum (System Power Down) */
+    0x29, 0x83,     /* Usage Maximum (System Wake Up) */
+    0x15, 0x00,     /* Logical Minimum (0) */
+    0x25, 0x01,     /* Logical Maximum (1) */
+    0x75, 0x01,     /* Report Size (1) */
+    0x95, 0x03,     /* Report Count (3) */
+    0x81, 0x02,     /* Input (Data, Variable, Absolute) */
+    0x95, 0x05,     /* Report Count (5) */
+    0x81, 0x01,     /* Input (Constant) */
+    0xC0            /* End Collection */
+};
+
+/* Pointer interface (HID_2): same layout as ZMK's mouse report, without an ID */
+static const uint8_t pointer_report_desc[] = {
+    0x05, 0x01,     /* Usage Page (Generic Desktop) */
+    0x09, 0x02,     /* Usage (Mouse) */
+    0xA1, 0x01,     /* Collection (Application) */
+    0x09, 0x01,     /* Usage (Pointer) */
+    0xA1, 0x00,     /* Collection (Physical) */
+
+    /* Buttons */
+    0x05, 0x09,     /* Usage Page (Button) */
+    0x19, 0x01,     /* Usage Minimum (1) */
+    0x29, USB_POINTER_BUTTONS, /* Usage Maximum (5) */
+    0x15, 0x00,     /* Logical Minimum (0) */
+    0x25, 0x01,     /* Logical Maximum (1) */
+    0x75, 0x01,     /* Report Size (1) */
+    0x95, USB_POINTER_BUTTONS, /* Report Count (5) */
+    0x81, 0x02,     /* Input (Data, Variable, Absolute) */
+    0x75, 0x03,     /* Report Size (3) */
+    0x95, 0x01,     /* Report Count (1) */
+    0x81, 0x01,     /* Input (Constant) */
+
+    /* X and Y */
+    0x05, 0x01,     /* Usage Page (Generic Desktop) */
+    0x09, 0x30,     /* Usage (X) */
+    0x09, 0x31,     /* Usage (Y) */
+    0x16, 0x01, 0x80, /* Logical Minimum (-32767) */
+    0x26, 0xFF, 0x7F, /* Logical Maximum (32767) */
+    0x75, 0x10,     /* Report Size (16) */
+    0x95, 0x02,     /* Report Count (2) */
+    0x81, 0x06,     /* Input (Data, Variable, Relative) */
+
+    /* Wheel */
+    0x09, 0x38,     /* Usage (Wheel) */
+    0x15, 0x81,     /* Logical Minimum (-127) */
+    0x25, 0x7F,     /* Logical Maximum (127) */
+    0x75, 0x08,     /* Report Size (8) */
+    0x95, 0x01,     /* Report Count (1) */
+    0x81, 0x06,     /* Input (Data, Variable, Relative) */
+
+    /* Horizontal scroll */
+    0x05, 0x0C,     /* Usage Page (Consumer) */
+    0x0A, 0x38, 0x02, /* Usage (AC Pan) */
+    0x95, 0x01,     /* Report Count (1) */
+    0x81, 0x06,     /* Input (Data, Variable, Relative) */
+
+    0xC0,           /* End Collection */
+    0xC0            /* End Collection */
+};
+
+/*
+ * The consumer, system and pointer layouts as field tables, for passthrough
+ * matching. The keyboard always goes through the key-state engine.
+ */
+static const struct report_field consumer_layout[] = {
+    { .bit_offset = 0, .bit_size = 16, .count = USB_CONSUMER_REPORT_KEYS, .flags = 0,
+      .usage_page = USAGE_PAGE_CONSUMER, .usage_min = 0x000, .usage_max = 0xFFF,
+      .logical_min = 0, .logical_max = 0xFFF },
+};
+
+static const struct report_field system_layout[] = {
+    { .bit_offset = 0, .bit_size = 1, .count = 3, .flags = REPORT_FIELD_VARIABLE,
+      .usage_page = USAGE_PAGE_GENERIC_DESKTOP, .usage_min = USAGE_GD_SYSTEM_POWER_DOWN,
+      .usage_max = USAGE_GD_SYSTEM_WAKE_UP, .logical_min = 0, .logical_max = 1 },
+};
+
+static const struct report_field pointer_layout[] = {
+    { .bit_offset = 0, .bit_size = 1, .count = USB_POINTER_BUTTONS,
+      .flags = REPORT_FIELD_VARIABLE, .usage_page = USAGE_PAGE_BUTTON,
+      .usage_min = 1, .usage_max = USB_POINTER_BUTTONS, .logical_min = 0, .logical_max = 1 },
+    { .bit_offset = 8, .bit_size = 16, .count = 2,
+      .flags = REPORT_FIELD_VARIABLE | REPORT_FIELD_RELATIVE,
+      .usage_page = USAGE_PAGE_GENERIC_DESKTOP, .usage_min = USAGE_GD_X,
+      .usage_max = USAGE_GD_Y, .logical_min = -32767, .logical_max = 32767 },
+    { .bit_offset = 40, .bit_size = 8, .count = 1,
+      .flags = REPORT_FIELD_VARIABLE | REPORT_FIELD_RELATIVE,
+      .usage_page = USAGE_PAGE_GENERIC_DESKTOP, .usage_min = USAGE_GD_WHEEL,
+      .usage_max = USAGE_GD_WHEEL, .logical_min = -127, .logical_max = 127 },
+    { .bit_offset = 48, .bit_size = 8, .count = 1,
+      .flags = REPORT_FIELD_VARIABLE | REPORT_FIELD_RELATIVE,
+      .usage_page = USAGE_PAGE_CONSUMER, .usage_min = USAGE_CONSUMER_AC_PAN,
+      .usage_max = USAGE_CONSUMER_AC_PAN, .logical_min = -127, .logical_max = 127 },
+};
+
+/* HID interfaces, one device instance and interrupt IN endpoint each */
+enum usb_iface_index {
+    USB_IFACE_KEYBOARD,
+    USB_IFACE_CONSUMER,
+    USB_IFACE_POINTER,
+    USB_IFACE_COUNT,
+};
+
+BUILD_ASSERT(USB_IFACE_COUNT <= CONFIG_USB_HID_DEVICE_COUNT,
+             "CONFIG_USB_HID_DEVICE_COUNT too small for the bridge interfaces");
+
+/*
+ * Current-state registers, one per report. A dirty bit marks a register
+ * whose latest state has not been sent yet.
+ */
+struct usb_report {
+    uint8_t iface;          /* enum usb_iface_index */
+    uint8_t id;             /* 0 if the interface uses no report IDs */
+    uint8_t size;
+    uint8_t protocols;      /* BIT(HID_PROTOCOL_*) the report is sent in */
+    bool relative;          /* Pointer motion: coalescing sums the deltas */
+    const struct report_field *layout;
+    uint8_t layout_fields;
+    uint8_t data[USB_REPORT_MAX_SIZE];
+};
+
+static struct usb_report usb_reports[USB_REPORT_SLOTS] = {
+    [USB_REPORT_KEYBOARD] = {
+        .iface = USB_IFACE_KEYBOARD, .id = 0, .size = USB_KEYBOARD_REPORT_SIZE,
+        .protocols = BIT(HID_PROTOCOL_REPORT),
+    },
+    [USB_REPORT_CONSUMER] = {
+        .iface = USB_IFACE_CONSUMER, .id = USB_REPORT_ID_CONSUMER,
+        .size = USB_CONSUMER_REPORT_SIZE, .protocols = BIT(HID_PROTOCOL_REPORT),
+        .layout = consumer_layout, .layout_fields = ARRAY_SIZE(consumer_layout),
+    },
+    [USB_REPORT_SYSTEM] = {
+        .iface = USB_IFACE_CONSUMER, .id = USB_REPORT_ID_SYSTEM,
+        .size = USB_SYSTEM_REPORT_SIZE, .protocols = BIT(HID_PROTOCOL_REPORT),
+        .layout = system_layout, .layout_fields = ARRAY_SIZE(system_layout),
+    },
+    [USB_REPORT_POINTER] = {
+        .iface = USB_IFACE_POINTER, .id = 0, .size = USB_POINTER_REPORT_SIZE,
+        .protocols = BIT(HID_PROTOCOL_REPORT), .relative = true,
+        .layout = pointer_layout, .layout_fields = ARRAY_SIZE(pointer_layout),
+    },
+    [USB_REPORT_BOOT_KEYBOARD] = {
+        .iface = USB_IFACE_KEYBOARD, .id = 0, .size = BOOT_REPORT_SIZE,
+        .protocols = BIT(HID_PROTOCOL_BOOT),
+    },
+};
+
+static uint8_t usb_report_count = USB_REPORT_COUNT;
+
+/* The writers scan the first word of the dirty bitmap only */
+BUILD_ASSERT(USB_REPORT_SLOTS <= ATOMIC_BITS, "Too many USB reports");
+
+static ATOMIC_DEFINE(usb_reports_dirty, USB_REPORT_SLOTS);
+/* Reports written since the last idle period, which need no repeat */
+static ATOMIC_DEFINE(usb_reports_sent, USB_REPORT_SLOTS);
+static struct k_spinlock usb_reports_lock;
+
+#if IS_ENABLED(CONFIG_BRIDGE_DESCRIPTOR_PASSTHROUGH)
+static uint8_t usb_desc_buf[REPORT_MAP_MAX_SIZE];
+static struct report_map usb_map;   /* Compiled usb_desc_buf */
+#endif
+static bool usb_raw;                /* The keyboard interface mirrors the Report Map */
+
+static bool usb_configured = false;
+static uint8_t usb_leds;       /* Last LED output report from the host */
+static const struct usb_bridge_cb *app_cb;
+
+/*
+ * USB IN report queues
+ *
+ * Only the producer moves head and only the holder of the interface's busy
+ * token moves tail, so no lock is needed and the BT RX thread never waits
+ * on a USB endpoint. Slots hold payloads; the report ID is added when the
+ * report is written, so a protocol switch never leaves stale framing in the
+ * queue.
+ */
+#define REPORT_QUEUE_DEPTH CONFIG_BRIDGE_REPORT_QUEUE_DEPTH
+BUILD_ASSERT(IS_POWER_OF_TWO(REPORT_QUEUE_DEPTH),
+             "BRIDGE_REPORT_QUEUE_DEPTH must be a power of two");
+
+struct report_slot {
+    uint8_t index;          /* enum usb_report_index */
+    uint8_t data[USB_REPORT_MAX_SIZE];
+};
+
+struct usb_iface {
+    const char *name;
+    const struct device *dev;
+    const uint8_t *desc;
+    uint16_t desc_len;
+    uint8_t boot_code;      /* HID_BOOT_IFACE_CODE_* */
+    uint8_t protocol;       /* HID_PROTOCOL_*, only the keyboard leaves report protocol */
+    atomic_val_t reports;   /* Bitmask of the usb_reports on this interface */
+
+    struct report_slot queue[REPORT_QUEUE_DEPTH];
+    atomic_t head;
+    atomic_t tail;
+    atomic_t busy;          /* Consumer token, set while a transfer is in flight */
+};
+
+static struct usb_iface usb_ifaces[USB_IFACE_COUNT] = {
+    [USB_IFACE_KEYBOARD] = {
+        .name = "HID_0", .desc = keyboard_report_desc,
+        .desc_len = sizeof(keyboard_report_desc),
+        .boot_code = HID_BOOT_IFACE_CODE_KEYBOARD,
+        .protocol = HID_PROTOCOL_REPORT,
+    },
+    [USB_IFACE_CONSUMER] = {
+        .name = "HID_1", .desc = consumer_report_desc,
+        .desc_len = sizeof(consumer_report_desc),
+        .boot_code = HID_BOOT_IFACE_CODE_NONE,
+        .protocol = HID_PROTOCOL_REPORT,
+    },
+    [USB_IFACE_POINTER] = {
+        .name = "HID_2", .desc = pointer_report_desc,
+        .desc_len = sizeof(pointer_report_desc),
+        .boot_code = HID_BOOT_IFACE_CODE_NONE,
+        .protocol = HID_PROTOCOL_REPORT,
+    },
+};
+
+static atomic_t report_queue_coalesced = ATOMIC_INIT(0);
+
+static struct usb_iface *usb_iface_of(const struct device *dev)
+{
+    for (int i = 0; i < USB_IFACE_COUNT; i++) {
+        if (usb_ifaces[i].dev == dev) {
+            return &usb_ifaces[i];
+        }
+    }
+
+    return NULL;
+}
+
+static bool usb_report_active(const struct usb_report *report)
+{
+    return report->protocols & BIT(usb_ifaces[report->iface].protocol);
+}
+
+static bool report_queue_empty(struct usb_iface *iface)
+{
+    return atomic_get(&iface->head) == atomic_get(&iface->tail);
+}
+
+/* Registers of this interface waiting for a re-send */
+static atomic_val_t usb_iface_dirty(struct usb_iface *iface)
+{
+    return atomic_get(&usb_reports_dirty[0]) & iface->reports;
+}
+
+/* True if anything is waiting for the interface's USB IN writer */
+static bool usb_in_pending(struct usb_iface *iface)
+{
+    return !report_queue_empty(iface) || usb_iface_dirty(iface);
+}
+
+/* Producer side: copy a report into the next free slot of its interface */
+static bool report_queue_put(uint8_t index, const uint8_t *data)
+{
+    struct usb_iface *iface = &usb_ifaces[usb_reports[index].iface];
+    uint32_t head = (uint32_t)atomic_get(&iface->head);
+    uint32_t tail = (uint32_t)atomic_get(&iface->tail);
+
+    if ((head - tail) >= REPORT_QUEUE_DEPTH) {
+        return false;
+    }
+
+    struct report_slot *slot = &iface->queue[head & (REPORT_QUEUE_DEPTH - 1)];
+
+    slot->index = index;
+    memcpy(slot->data, data, usb_reports[index].size);
+
+    /* Publish the slot only after its contents are written */
+    atomic_set(&iface->head, (atomic_val_t)(head + 1));
+    return true;
+}
+
+/*
+ * Frame a payload for the current protocol and start the transfer.
+ * Returns 1 if a transfer was started, 0 if the report does not exist in
+ * the current protocol, or a negative error code.
+ */
+static int usb_in_write(uint8_t index, const uint8_t *payload)
+{
+    const struct usb_report *report = &usb_reports[index];
+    const struct device *dev = usb_ifaces[report->iface].dev;
+    uint8_t buf[USB_REPORT_MAX_SIZE + 1];
+    int ret;
+
+    if (!usb_report_active(report)) {
+        return 0;
+    }
+
+    if (report->id == 0) {
+        ret = hid_int_ep_write(dev, payload, report->size, NULL);
+    } else {
+        buf[0] = report->id;
+        memcpy(&buf[1], payload, report->size);
+        ret = hid_int_ep_write(dev, buf, report->size + 1, NULL);
+    }
+
+    if (ret < 0) {
+        if (ret != -EAGAIN) {
+            LOG_ERR("Failed to send HID report %u: %d", report->id, ret);
+        }
+        return ret;
+    }
+
+    atomic_set_bit(usb_reports_sent, index);
+    return 1;
+}
+
+/* Sum two relative values, saturating at the field's range */
+static void usb_pointer_add(uint8_t *acc, const uint8_t *delta, uint8_t size)
+{
+    if (size == 2) {
+        int32_t v = (int16_t)sys_get_le16(acc) + (int16_t)sys_get_le16(delta);
+
+        sys_put_le16((uint16_t)CLAMP(v, -32767, 32767), acc);
+    } else {
+        int32_t v = (int8_t)*acc + (int8_t)*delta;
+
+        *acc = (uint8_t)CLAMP(v, -127, 127);
+    }
+}
+
+/* Coalesce a pointer report: newest buttons, accumulated motion */
+static void usb_pointer_merge(uint8_t *reg, const uint8_t *data)
+{
+    reg[0] = data[0];
+    usb_pointer_add(&reg[USB_POINTER_X], &data[USB_POINTER_X], 2);
+    usb_pointer_add(&reg[USB_POINTER_Y], &data[USB_POINTER_Y], 2);
+    usb_pointer_add(&reg[USB_POINTER_WHEEL], &data[USB_POINTER_WHEEL], 1);
+    usb_pointer_add(&reg[USB_POINTER_PAN], &data[USB_POINTER_PAN], 1);
+}
+
+/* Motion handed to the host must not be sent again on a re-send */
+static void usb_report_settle(struct usb_report *report)
+{
+    if (report->relative) {
+        memset(&report->data[USB_POINTER_X], 0,
+               USB_POINTER_REPORT_SIZE - USB_POINTER_X);
+    }
+}
+
+/* Consumer side: send a coalesced current-state register */
+static int usb_in_write_state(uint8_t index)
+{
+    struct usb_report *report = &usb_reports[index];
+    uint8_t state[USB_REPORT_MAX_SIZE];
+    k_spinlock_key_t key;
+
+    key = k_spin_lock(&usb_reports_lock);
+    memcpy(state, report->data, report->size);
+    usb_report_settle(report);
+    atomic_clear_bit(usb_reports_dirty, index);
+    k_spin_unlock(&usb_reports_lock, key);
+
+    int ret = usb_in_write(index, state);
+    if (ret < 0) {
+        /* Keep the register pending; it may already hold a newer state */
+        key = k_spin_lock(&usb_reports_lock);
+        if (report->relative) {
+            /* Put the motion taken back; the register's buttons are newer */
+            uint8_t buttons = report->data[0];
+
+            usb_pointer_merge(report->data, state);
+            report->data[0] = buttons;
+        }
+        atomic_set_bit(usb_reports_dirty, index);
+        k_spin_unlock(&usb_reports_lock, key);
+    }
+
+    return ret;
+}
+
+/*
+ * Consumer side: start a transfer for the oldest queued report, or for a
+ * coalesced register once the queue is empty. Caller must hold iface->busy.
+ * Returns 1 if a transfer was started, 0 if nothing is pending, or a
+ * negative error code.
+ */
+static int usb_in_write_next(struct usb_iface *iface)
+{
+    if (!usb_in_pending(iface)) {
+        return 0;
+    }
+
+    if (!usb_configured || !iface->dev) {
+        return -ENODEV;
+    }
+
+    for (;;) {
+        uint32_t tail = (uint32_t)atomic_get(&iface->tail);
+        int ret;
+
+        if (tail != (uint32_t)atomic_get(&iface->head)) {
+            struct report_slot *slot = &iface->queue[tail & (REPORT_QUEUE_DEPTH - 1)];
+
+            ret = usb_in_write(slot->index, slot->data);
+            if (ret < 0) {
+                return ret;
+            }
+
+            /* The endpoint buffer holds its own copy, so the slot can be released */
+            atomic_set(&iface->tail, (atomic_val_t)(tail + 1));
+        } else {
+            atomic_val_t dirty = usb_iface_dirty(iface);
+
+            if (!dirty) {
+                return 0;
+            }
+
+            ret = usb_in_write_state(__builtin_ctz((unsigned int)dirty));
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        if (ret > 0) {
+            return 1;
+        }
+        /* Report not part of the current protocol, try the next one */
+    }
+}
+
+/* Start the interface's USB IN writer if no transfer is in flight */
+static void usb_in_kick(struct usb_iface *iface)
+{
+    while (atomic_cas(&iface->busy, 0, 1)) {
+        int ret = usb_in_write_next(iface);
+        if (ret > 0) {
+            /* int_in_ready continues draining when this transfer completes */
+            return;
+        }
+
+        atomic_clear(&iface->busy);
+
+        /* A report enqueued between the empty check and the release
+         * would otherwise sit in the queue until the next notification.
+         */
+        if (ret < 0 || !usb_in_pending(iface)) {
+            return;
+        }
+    }
+}
+
+/* Drop reports queued for a previous USB session */
+static void usb_in_flush(struct usb_iface *iface)
+{
+    if (atomic_cas(&iface->busy, 0, 1)) {
+        atomic_set(&iface->tail, atomic_get(&iface->head));
+        atomic_clear(&iface->busy);
+    }
+}
+
+/* Mark the interface's registers for a re-send so the host sees the current state */
+static void usb_in_resync(struct usb_iface *iface)
+{
+    atomic_or(&usb_reports_dirty[0], iface->reports);
+    usb_in_kick(iface);
+}
+
+/*
+ * Update a current-state register and pass the new state to the host.
+ * An absolute report equal to the state already passed on is dropped.
+ * While the queue has room every report is kept in order; once it fills
+ * up, further reports are merged into their register until the writer
+ * catches up, so memory stays bounded no matter how long the burst is.
+ */
+static void usb_report_update(uint8_t index, const uint8_t *data, uint16_t len)
+{
+    struct usb_report *report = &usb_reports[index];
+    struct usb_iface *iface = &usb_ifaces[report->iface];
+    k_spinlock_key_t key;
+    bool coalesced = false;
+
+    len = MIN(len, report->size);
+
+    key = k_spin_lock(&usb_reports_lock);
+
+    if (report->relative && atomic_test_bit(usb_reports_dirty, index) &&
+        len == report->size) {
+        /* Unsent motion is still in the register */
+        usb_pointer_merge(report->data, data);
+    } else {
+        uint8_t state[USB_REPORT_MAX_SIZE] = {0};
+
+        /* A short report leaves no stale bytes behind */
+        memcpy(state, data, len);
+
+        /* Same state as the one already passed on: nothing to repeat */
+        if (!memcmp(report->data, state, report->size) &&
+            !atomic_test_bit(usb_reports_dirty, index)) {
+            k_spin_unlock(&usb_reports_lock, key);
+            return;
+        }
+        memcpy(report->data, state, report->size);
+    }
+
+    /* Reports of the other protocol only keep their register current */
+    if (!usb_report_active(report)) {
+        k_spin_unlock(&usb_reports_lock, key);
+        return;
+    }
+
+    /* Once a report is coalescing, queueing it would reorder its states */
+    if (!usb_configured || atomic_test_bit(usb_reports_dirty, index) ||
+        !report_queue_put(index, report->data)) {
+        atomic_set_bit(usb_reports_dirty, index);
+        coalesced = usb_configured;
+    } else {
+        usb_report_settle(report);
+    }
+
+    k_spin_unlock(&usb_reports_lock, key);
+
+    if (coalesced) {
+        atomic_inc(&report_queue_coalesced);
+        LOG_DBG("USB backpressure, report coalesced (%ld total)",
+                (long)atomic_get(&report_queue_coalesced));
+    }
+
+    usb_in_kick(iface);
+}
+
+void usb_bridge_report(enum usb_report_index index, const uint8_t *data,
+                       uint16_t len)
+{
+    usb_report_update(index, data, len);
+}
+
+int usb_bridge_forward(uint8_t id, const uint8_t *data, uint16_t len)
+{
+    for (uint8_t i = USB_REPORT_COUNT; i < usb_report_count; i++) {
+        if (usb_reports[i].id == id) {
+            usb_report_update(i, data, len);
+            return 0;
+        }
+    }
+
+    return -ENOENT;
+}
+
+bool usb_bridge_passthrough(void)
+{
+    return usb_raw;
+}
+
+#if IS_ENABLED(CONFIG_BRIDGE_DESCRIPTOR_PASSTHROUGH)
+int usb_bridge_set_descriptor(const uint8_t *desc, uint16_t len)
+{
+    struct usb_iface *iface = &usb_ifaces[USB_IFACE_KEYBOARD];
+    uint8_t count = USB_REPORT_COUNT;
+    int err;
+
+    if (len > sizeof(usb_desc_buf)) {
+        return -ENOMEM;
+    }
+
+    err = report_map_parse(&usb_map, desc, len);
+    if (err) {
+        return err;
+    }
+
+    for (uint8_t i = 0; i < usb_map.report_count; i++) {
+        const struct report_info *rep = &usb_map.reports[i];
+
+        if (rep->type != REPORT_TYPE_INPUT) {
+            continue;
+        }
+
+        if (report_info_size(rep) > USB_RAW_REPORT_MAX_SIZE) {
+            LOG_WRN("Report ID %u too large to mirror", rep->id);
+            return -ENOMEM;
+        }
+
+        usb_reports[count++] = (struct usb_report){
+            .iface = USB_IFACE_KEYBOARD, .id = rep->id,
+            .size = report_info_size(rep), .protocols = BIT(HID_PROTOCOL_REPORT),
+        };
+    }
+
+    /*
+     * The mirrored map replaces the keyboard interface's descriptor and
+     * covers everything the keyboard sends; the fixed reports go quiet.
+     */
+    for (uint8_t i = 0; i < USB_REPORT_COUNT; i++) {
+        if (i != USB_REPORT_BOOT_KEYBOARD) {
+            usb_reports[i].protocols = 0;
+        }
+    }
+
+    memcpy(usb_desc_buf, desc, len);
+    iface->desc = usb_desc_buf;
+    iface->desc_len = len;
+    usb_report_count = count;
+    usb_raw = true;
+
+    LOG_INF("USB descriptor mirrors the keyboard's Report Map (%u bytes)", len);
+    return 0;
+}
+#else
+int usb_bridge_set_descriptor(const uint8_t *desc, uint16_t len)
+{
+    return -ENOTSUP;
+}
+#endif
+
+/*
+ * Switch protocol under the register lock, so a producer either sees the
+ * new protocol or finishes its register update before the resync reads it.
+ */
+static void usb_bridge_set_protocol(struct usb_iface *iface, uint8_t protocol)
+{
+    k_spinlock_key_t key = k_spin_lock(&usb_reports_lock);
+
+    iface->protocol = protocol;
+    k_spin_unlock(&usb_reports_lock, key);
+}
+
+bool usb_bridge_layout_matches(enum usb_report_index index,
+                               const struct report_map *map,
+                               const struct report_info *info)
+{
+    const struct usb_report *report = &usb_reports[index];
+
+    return report->layout && report_info_size(info) == report->size &&
+           report_map_layout_matches(map, info, report->layout,
+                                     report->layout_fields);
+}
+
+/* Report the host means by ID on an interface in its current protocol, or -ENOENT */
+static int usb_report_lookup(struct usb_iface *iface, uint8_t id)
+{
+    for (int i = 0; i < usb_report_count; i++) {
+        const struct usb_report *report = &usb_reports[i];
+
+        if (&usb_ifaces[report->iface] != iface || !usb_report_active(report)) {
+            continue;
+        }
+
+        /* Boot protocol has a single report and no IDs */
+        if (iface->protocol == HID_PROTOCOL_BOOT || report->id == id) {
+            return i;
+        }
+    }
+
+    return -ENOENT;
+}
+
+/* USB HID Callbacks */
+static void usb_bridge_status_cb(enum usb_dc_status_code status,
+                                 const uint8_t *param)
+{
+    switch (status) {
+    case USB_DC_RESET:
+        /* HID devices come out of reset in report protocol */
+        for (int i = 0; i < USB_IFACE_COUNT; i++) {
+            usb_bridge_set_protocol(&usb_ifaces[i], HID_PROTOCOL_REPORT);
+        }
+        break;
+    case USB_DC_CONFIGURED:
+        LOG_INF("USB configured");
+        for (int i = 0; i < USB_IFACE_COUNT; i++) {
+            /* Any transfer in flight was aborted by the bus reset */
+            atomic_clear(&usb_ifaces[i].busy);
+            usb_in_flush(&usb_ifaces[i]);
+        }
+        usb_configured = true;
+        /* Re-sync the host with the keys currently held */
+        for (int i = 0; i < USB_IFACE_COUNT; i++) {
+            usb_in_resync(&usb_ifaces[i]);
+        }
+        break;
+    case USB_DC_DISCONNECTED:
+        LOG_INF("USB disconnected");
+        usb_configured = false;
+        for (int i = 0; i < USB_IFACE_COUNT; i++) {
+            atomic_clear(&usb_ifaces[i].busy);
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (app_cb && app_cb->status) {
+        app_cb->status(status, param);
+    }
+}
+
+/* Previous IN transfer completed - hand the endpoint to the next queued report */
+static void usb_int_in_ready(const struct device *dev)
+{
+    struct usb_iface *iface = usb_iface_of(dev);
+
+    if (iface) {
+        atomic_clear(&iface->busy);
+        usb_in_kick(iface);
+    }
+}
+
+/* SET_PROTOCOL from the host (BIOS selects boot protocol) */
+static void usb_protocol_change(const struct device *dev, uint8_t protocol)
+{
+    struct usb_iface *iface = usb_iface_of(dev);
+
+    if (!iface) {
+        return;
+    }
+
+    LOG_INF("USB HID protocol on %s: %s", iface->name,
+            protocol == HID_PROTOCOL_BOOT ? "boot" : "report");
+    usb_bridge_set_protocol(iface, protocol);
+    usb_in_resync(iface);
+}
+
+/* GET_REPORT: answered from the current-state register, never from the keyboard */
+static int usb_get_report(const struct device *dev, struct usb_setup_packet *setup,
+                          int32_t *len, uint8_t **data)
+{
+    /* The control transfer sends from this buffer after we return */
+    static uint8_t buf[USB_REPORT_MAX_SIZE + 1];
+    struct usb_iface *iface = usb_iface_of(dev);
+    uint8_t type = setup->wValue >> 8;
+    uint8_t id = setup->wValue & 0xFF;
+    const struct usb_report *report;
+    k_spinlock_key_t key;
+    uint8_t offset;
+    int index;
+
+    if (!iface) {
+        return -ENODEV;
+    }
+
+    if (type == REPORT_TYPE_OUTPUT && iface == &usb_ifaces[USB_IFACE_KEYBOARD]) {
+        if (usb_raw && iface->protocol == HID_PROTOCOL_REPORT) {
+            /* The mirrored LED layout is only known to the keyboard */
+            return -ENOTSUP;
+        }
+        buf[0] = usb_leds;
+        *data = buf;
+        *len = 1;
+        return 0;
+    }
+
+    if (type != REPORT_TYPE_INPUT) {
+        return -ENOTSUP;
+    }
+
+    index = usb_report_lookup(iface, id);
+    if (index < 0) {
+        LOG_WRN("GET_REPORT for unknown report ID %u on %s", id, iface->name);
+        return index;
+    }
+
+    report = &usb_reports[index];
+    offset = report->id ? 1 : 0;
+    buf[0] = report->id;
+
+    key = k_spin_lock(&usb_reports_lock);
+    memcpy(&buf[offset], report->data, report->size);
+    k_spin_unlock(&usb_reports_lock, key);
+
+    *data = buf;
+    *len = report->size + offset;
+    return 0;
+}
+
+/*
+ * Idle period set by SET_IDLE has elapsed. Repeat the current state only if
+ * the report has not gone out since the previous period; a report sent on
+ * change already restarted the host's idle timer.
+ */
+static void usb_on_idle(const struct device *dev, uint16_t report_id)
+{
+    struct usb_iface *iface = usb_iface_of(dev);
+    int index;
+
+    if (!iface) {
+        return;
+    }
+
+    index = usb_report_lookup(iface, (uint8_t)report_id);
+    if (index < 0 || atomic_test_and_clear_bit(usb_reports_sent, index)) {
+        return;
+    }
+
+    atomic_set_bit(usb_reports_dirty, index);
+    usb_in_kick(iface);
+}
+
+/*
+ * LED output report from the host, by SET_REPORT or on the interrupt OUT
+ * endpoint of the keyboard interface.
+ */
+static int usb_output_leds(const uint8_t *data, uint32_t len)
+{
+#if IS_ENABLED(CONFIG_BRIDGE_DESCRIPTOR_PASSTHROUGH)
+    if (usb_raw && usb_ifaces[USB_IFACE_KEYBOARD].protocol == HID_PROTOCOL_REPORT &&
+        len > 0) {
+        /* Mirrored descriptor: the keyboard's own LED report layout */
+        uint8_t id = usb_map.report_ids ? data[0] : 0;
+        uint8_t offset = id ? 1 : 0;
+        const struct report_info *rep;
+        uint16_t usages[8];
+        uint8_t count;
+        int leds = 0;
+
+        rep = report_map_find(&usb_map, REPORT_TYPE_OUTPUT, id);
+        if (!rep) {
+            return -ENOENT;
+        }
+
+        count = report_map_collect_usages(&usb_map, rep, data + offset,
+                                          len - offset, USAGE_PAGE_LED,
+                                          usages, ARRAY_SIZE(usages));
+        for (uint8_t i = 0; i < count; i++) {
+            /* One bit of the boot LED byte each, from Num Lock up */
+            if (usages[i] >= USAGE_LED_NUM_LOCK && usages[i] < USAGE_LED_NUM_LOCK + 8) {
+                leds |= BIT(usages[i] - USAGE_LED_NUM_LOCK);
+            }
+        }
+        return leds;
+    }
+#endif
+
+    /* No report ID on the keyboard interface in either protocol */
+    return (len == 1) ? data[0] : -EINVAL;
+}
+
+static void usb_output_report(const uint8_t *data, uint32_t len)
+{
+    int leds = usb_output_leds(data, len);
+
+    if (leds < 0) {
+        LOG_WRN("Unexpected output report of %u bytes", len);
+        return;
+    }
+
+    if (leds == usb_leds) {
+        return;
+    }
+
+    usb_leds = leds;
+    LOG_DBG("Host LEDs 0x%02x", leds);
+
+    if (app_cb && app_cb->leds) {
+        app_cb->leds(leds);
+    }
+}
+
+static int usb_set_report(const struct device *dev, struct usb_setup_packet *setup,
+                          int32_t *len, uint8_t **data)
+{
+    if (dev != usb_ifaces[USB_IFACE_KEYBOARD].dev ||
+        (setup->wValue >> 8) != REPORT_TYPE_OUTPUT) {
+        return -ENOTSUP;
+    }
+
+    usb_output_report(*data, (uint32_t)*len);
+    return 0;
+}
+
+static void usb_int_out_ready(const struct device *dev)
+{
+    uint8_t buf[8];
+    uint32_t len = 0;
+
+    if (hid_int_ep_read(dev, buf, sizeof(buf), &len) == 0 && len > 0 &&
+        dev == usb_ifaces[USB_IFACE_KEYBOARD].dev) {
+        usb_output_report(buf, len);
+    }
+}
+
+static const struct hid_ops hid_ops = {
+    .get_report = usb_get_report,
+    .set_report = usb_set_report,
+    .protocol_change = usb_protocol_change,
+    .on_idle = usb_on_idle,
+    .int_in_ready = usb_int_in_ready,
+    .int_out_ready = usb_int_out_ready,
+};
+
+static int usb_iface_init(struct usb_iface *iface)
+{
+    int err;
+
+    iface->dev = device_get_binding(iface->name);
+    if (!iface->dev) {
+        LOG_ERR("Cannot get HID device %s", iface->name);
+        return -ENODEV;
+    }
+
+    usb_hid_register_device(iface->dev, iface->desc, iface->desc_len, &hid_ops);
+
+    /* Boot interface subclass, so a BIOS can select boot protocol */
+    err = usb_hid_set_proto_code(iface->dev, iface->boot_code);
+    if (err) {
+        LOG_WRN("Failed to set boot protocol code on %s: %d", iface->name, err);
+    }
+
+    err = usb_hid_init(iface->dev);
+    if (err) {
+        LOG_ERR("Failed to init USB HID %s: %d", iface->name, err);
+    }
+
+    return err;
+}
+
+int usb_bridge_init(const struct usb_bridge_cb *cb)
+{
+    int err;
+
+    app_cb = cb;
+
+    for (uint8_t i = 0; i < usb_report_count; i++) {
+        usb_ifaces[usb_reports[i].iface].reports |= BIT(i);
+    }
+
+    for (int i = 0; i < USB_IFACE_COUNT; i++) {
+        err = usb_iface_init(&usb_ifaces[i]);
+        if (err) {
+            return err;
+        }
+    }
+
+    err = usb_enable(usb_bridge_status_cb);
+    if (err) {
+        LOG_ERR("Failed to enable USB: %d", err);
+        return err;
+    }
+
+    return 0;
+}
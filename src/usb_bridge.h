@@ -0,0 +1,113 @@
+/*
+ * USB side of the bridge
+ *
+ * Owns the USB HID interfaces, their report descriptors and the path from
+ * the BLE notification handler to the interrupt IN endpoints, plus the
+ * host's LED output report in the other direction.
+ *
+ * Keyboard, consumer/system and pointer reports each have their own HID
+ * interface and endpoint, so traffic of one kind never waits behind
+ * another. The keyboard interface stays boot-compatible on its own.
+ */
+
+#ifndef USB_BRIDGE_H_
+#define USB_BRIDGE_H_
+
+#include <zephyr/sys/util.h>
+#include <zephyr/usb/usb_device.h>
+
+#include "report_map.h"
+#include "key_state.h"
+
+/* Reports exposed to the host, one current-state register each */
+enum usb_report_index {
+    USB_REPORT_KEYBOARD,
+    USB_REPORT_CONSUMER,
+    USB_REPORT_SYSTEM,
+    USB_REPORT_POINTER,
+    USB_REPORT_BOOT_KEYBOARD,   /* Sent instead of the keyboard report in boot protocol */
+    USB_REPORT_COUNT,
+};
+
+/* Only the consumer interface carries more than one report */
+#define USB_REPORT_ID_CONSUMER      1
+#define USB_REPORT_ID_SYSTEM        2
+
+/* Payload sizes, report ID excluded */
+#if IS_ENABLED(CONFIG_BRIDGE_USB_NKRO)
+#define USB_KEYBOARD_REPORT_SIZE    NKRO_REPORT_SIZE
+#else
+#define USB_KEYBOARD_REPORT_SIZE    BOOT_REPORT_SIZE
+#endif
+#define USB_CONSUMER_REPORT_KEYS    6
+#define USB_CONSUMER_REPORT_SIZE    (USB_CONSUMER_REPORT_KEYS * 2)
+#define USB_SYSTEM_REPORT_SIZE      1
+
+/* Pointer: 5 buttons, 16-bit X/Y, 8-bit wheel and pan, all relative */
+#define USB_POINTER_BUTTONS         5
+#define USB_POINTER_REPORT_SIZE     7
+#define USB_POINTER_X               1   /* Payload byte offsets */
+#define USB_POINTER_Y               3
+#define USB_POINTER_WHEEL           5
+#define USB_POINTER_PAN             6
+
+/*
+ * Descriptor passthrough: the keyboard's own input reports get registers
+ * after the fixed ones, up to one interrupt packet each with the report ID.
+ */
+#if IS_ENABLED(CONFIG_BRIDGE_DESCRIPTOR_PASSTHROUGH)
+#define USB_RAW_REPORTS             REPORT_MAP_MAX_REPORTS
+#define USB_RAW_REPORT_MAX_SIZE     (CONFIG_HID_INTERRUPT_EP_MPS - 1)
+#else
+#define USB_RAW_REPORTS             0
+#define USB_RAW_REPORT_MAX_SIZE     0
+#endif
+#define USB_REPORT_SLOTS            (USB_REPORT_COUNT + USB_RAW_REPORTS)
+
+#define USB_REPORT_MAX_SIZE         MAX(MAX(USB_KEYBOARD_REPORT_SIZE, USB_CONSUMER_REPORT_SIZE), \
+                                        USB_RAW_REPORT_MAX_SIZE)
+
+struct usb_bridge_cb {
+    /* Called after the bridge has handled each USB device status change */
+    usb_dc_status_callback status;
+    /* Host changed the keyboard LEDs; bit n is LED usage n + 1. ISR context. */
+    void (*leds)(uint8_t leds);
+};
+
+/*
+ * Use a keyboard's Report Map as the USB report descriptor, so its input
+ * reports can be forwarded verbatim with usb_bridge_forward(). Call before
+ * usb_bridge_init(). On error the fixed descriptor stays in use.
+ */
+int usb_bridge_set_descriptor(const uint8_t *desc, uint16_t len);
+
+/* True if the USB descriptor is a keyboard's Report Map */
+bool usb_bridge_passthrough(void);
+
+/* Register and enable the USB HID interfaces */
+int usb_bridge_init(const struct usb_bridge_cb *cb);
+
+/*
+ * Set the current state of a report and pass it to the host. Never blocks;
+ * safe to call from the BT RX thread. Pointer motion is relative: reports
+ * coalesced under backpressure have their deltas summed.
+ */
+void usb_bridge_report(enum usb_report_index index, const uint8_t *data,
+                       uint16_t len);
+
+/*
+ * Forward a keyboard input report verbatim in descriptor passthrough mode.
+ * Same queueing and coalescing as usb_bridge_report(). Returns -ENOENT if
+ * the mirrored descriptor has no such report.
+ */
+int usb_bridge_forward(uint8_t id, const uint8_t *data, uint16_t len);
+
+/*
+ * True if a keyboard report has the same payload layout as the USB report,
+ * so it can be forwarded without translation.
+ */
+bool usb_bridge_layout_matches(enum usb_report_index index,
+                               const struct report_map *map,
+                               const struct report_info *info);
+
+#endif /* USB_BRIDGE_H_ */